@@ -0,0 +1,232 @@
+#include "common.hpp"
+#include "parser.hpp"
+#include "assembler.hpp"
+#include "files.hpp"
+#include "preprocessor.hpp"
+#include "arguments.hpp"
+#include "corpus.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Phase { PhaseRead, PhasePreprocess, PhaseAssemble, PhaseSave, PhaseNum };
+
+constexpr const char *phaseNames[PhaseNum]{ "read", "preprocess", "assemble", "save" };
+
+struct RunTimes {
+	double ms[PhaseNum]{};
+	double total() const { return ms[PhaseRead] + ms[PhasePreprocess] + ms[PhaseAssemble] + ms[PhaseSave]; }
+};
+
+double msSince(Clock::time_point start_) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start_).count();
+}
+
+// Same steps as main(), each one timed. Returns false and prints the error if the compilation fails
+bool compileOnce(const string &src_, const string &out_, unsigned int threads_, RunTimes &rTimes_, size_t &rByteNum_) {
+	std::pmr::monotonic_buffer_resource exprMemory;
+	std::pmr::unsynchronized_pool_resource exprPool(&exprMemory);
+	exprArena = &exprPool;
+
+	FoldCache constants;
+	foldCache = &constants;
+
+	vector<ProcessedFile> fileStack;
+	vector<Expression> tokScript;
+	CodeImage code;
+	vector<Marker> markers;
+
+	auto start = Clock::now();
+	if (!readFile(tokScript, src_)) {
+		fputs(("Error: Unable to open file \"" + src_ + "\".\n").c_str(), stdout);
+		return 0;
+	}
+	rTimes_.ms[PhaseRead] = msSince(start);
+
+	ProcessedFile mainFile;
+	mainFile.location = src_;
+	mainFile.line = 0;
+	fileStack.push_back(mainFile);
+
+	start = Clock::now();
+	Result result = preprocessor(tokScript, fileStack);
+	rTimes_.ms[PhasePreprocess] = msSince(start);
+
+	if (result.code == NoError) {
+		int instructionCount;
+		fileStack[0] = mainFile;
+
+		start = Clock::now();
+		result = assembleCode(tokScript, code, markers, false, fileStack, instructionCount, threads_);
+		rTimes_.ms[PhaseAssemble] = msSince(start);
+	}
+
+	if (result.code != NoError) {
+		string errStr = "Compilation failed:\nfile: \"" + fileStack[0].location.name + "\", line: " + numToStr(fileStack[0].line + 1) + "\n";
+		errStr += "error: (" + numToStr((int)result.code) + ") " + result.getErrorMessage() + "\n";
+		fputs(errStr.c_str(), stdout);
+		return 0;
+	}
+
+	start = Clock::now();
+	if (!saveCode(code, out_, 16, true, markers, &rByteNum_, threads_)) {
+		fputs(("Error: Unable to open file \"" + out_ + "\".\n").c_str(), stdout);
+		return 0;
+	}
+	rTimes_.ms[PhaseSave] = msSince(start);
+
+	return 1;
+}
+
+// Runs the compilation runs_ times and prints the fastest and the mean time of every phase
+bool benchFile(const string &src_, const string &out_, int runs_, unsigned int threads_, const string &label_) {
+	RunTimes best, sum;
+	size_t byteNum = 0;
+
+	for (int r = 0; r < runs_; r++) {
+		RunTimes times;
+		if (!compileOnce(src_, out_, threads_, times, byteNum)) return 0;
+
+		for (int p = 0; p < PhaseNum; p++) {
+			if (r == 0 || times.ms[p] < best.ms[p]) best.ms[p] = times.ms[p];
+			sum.ms[p] += times.ms[p];
+		}
+	}
+
+	string row = label_;
+	row.resize(std::max<size_t>(row.size() + 1, 24), ' ');
+
+	char buf[32];
+	for (int p = 0; p < PhaseNum; p++) {
+		snprintf(buf, sizeof(buf), "%9.2f/%-10.2f", best.ms[p], sum.ms[p] / runs_);
+		row += buf;
+	}
+	snprintf(buf, sizeof(buf), "%9.2f/%-10.2f", best.total(), sum.total() / runs_);
+	row += buf;
+	row += numToStr(byteNum) + "\n";
+
+	fputs(row.c_str(), stdout);
+	return 1;
+}
+
+void printHeader() {
+	string header = "corpus";
+	header.resize(24, ' ');
+
+	char buf[32];
+	for (int p = 0; p < PhaseNum; p++) {
+		snprintf(buf, sizeof(buf), "%-20s", phaseNames[p]);
+		header += buf;
+	}
+	header += "total               bytes\n";
+
+	fputs("Times in ms, fastest/mean run\n", stdout);
+	fputs(header.c_str(), stdout);
+}
+
+template <typename T>
+void readFlag(const CommandArguments &args_, const string &name_, T &rVal_) {
+	auto it = args_.longFlags.find(name_);
+	if (it != args_.longFlags.end()) {
+		T val;
+		if (strToNum(it->second, val)) rVal_ = val;
+	}
+}
+
+}
+
+int main(int argc, char* argv[]) {
+
+	CommandArguments args;
+	args.parse(argc, argv);
+
+	if (args.shortFlags['h']) {
+		fputs(
+			"Usage:\n"
+			"  sb-uasm-bench [options] [src...]\n"
+			"\n"
+			"Compiles every src file, or a generated corpus if none is given, and times each phase.\n"
+			"\n"
+			"Options:\n"
+			"  --runs=5          - Compilations of every corpus\n"
+			"  --dir=bench-out   - Directory for the generated corpus and the output files\n"
+			"  --steps=1         - Number of generated corpora, each one twice as long as the previous one\n"
+			"  --threads=1       - Threads encoding the instructions and writing the output, 0 uses all cores\n"
+			"  --cache-dir=      - Token cache for the included files, warmed by the first run\n"
+			"  --lines=10000     - Lines of code in the main file\n"
+			"  --depth=3         - Libraries included one from another\n"
+			"  --macros=64       - Function-like macros\n"
+			"  --args=2          - Parameters of every macro\n"
+			"  --labels=256      - Labels in the main file\n"
+			"  --if-density=0.1  - Chance that a line starts an %if/%elif/%else block\n"
+			"  --seed=1          - Seed of the generator\n",
+			stdout
+		);
+		return 0;
+	}
+
+	int runs = 5, steps = 1;
+	unsigned int threads = 1;
+	string dir = "bench-out";
+	readFlag(args, "runs", runs);
+	readFlag(args, "steps", steps);
+	readFlag(args, "threads", threads);
+	if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+	if (auto it = args.longFlags.find("dir"); it != args.longFlags.end()) dir = it->second;
+	if (runs < 1) runs = 1;
+
+	std::optional<TokenCache> libraryCache;
+	if (auto it = args.longFlags.find("cache-dir"); it != args.longFlags.end()) {
+		std::error_code ec;
+		std::filesystem::create_directories(it->second, ec);
+		if (ec) {
+			fputs(("Error: Unable to create directory \"" + it->second + "\".\n").c_str(), stdout);
+			return -2;
+		}
+		tokenCache = &libraryCache.emplace(it->second);
+	}
+
+	CorpusParams params;
+	readFlag(args, "lines", params.lines);
+	readFlag(args, "depth", params.includeDepth);
+	readFlag(args, "macros", params.macros);
+	readFlag(args, "args", params.macroArgs);
+	readFlag(args, "labels", params.labels);
+	readFlag(args, "if-density", params.ifDensity);
+	readFlag(args, "seed", params.seed);
+
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	if (ec) {
+		fputs(("Error: Unable to create directory \"" + dir + "\".\n").c_str(), stdout);
+		return -2;
+	}
+	string outPath = dir + "/out.txt";
+
+	printHeader();
+
+	// args[0] is the executable
+	if (args.args.size() > 1) {
+		for (size_t i = 1; i < args.args.size(); i++)
+			if (!benchFile(args.args[i], outPath, runs, threads, args.args[i])) return -1;
+		return 0;
+	}
+
+	for (int s = 0; s < steps; s++) {
+		string mainPath = generateCorpus(params, dir);
+		if (mainPath.empty()) {
+			fputs(("Error: Unable to write the corpus into \"" + dir + "\".\n").c_str(), stdout);
+			return -2;
+		}
+
+		if (!benchFile(mainPath, outPath, runs, threads, numToStr(params.lines) + " lines")) return -1;
+		params.lines *= 2;
+	}
+
+	return 0;
+}
\ No newline at end of file
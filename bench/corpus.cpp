@@ -0,0 +1,155 @@
+#include "corpus.hpp"
+#include "parser.hpp"
+
+#include <random>
+
+namespace {
+
+// Instruction set of the generated programs, defined with %mnemonic
+constexpr const char *mnemonics[]{
+	"nop _2n16",
+	"ldi(dest val) _2i4r4i8 0x3 dest val",
+	"add(dest a b) _2i4r4r4r4 0x8 dest a b",
+	"mov(dest a) _2i4r4r4r4 0x9 dest a a",
+	"jmp(lo hi) _3i8i8i8 0x20 lo hi",
+	"psh(val) _2i8i8 0x70 val"
+};
+
+class CorpusWriter {
+public:
+	CorpusWriter(const CorpusParams &params_) : params(params_), rng(params_.seed) {}
+
+	void writeMnemonics(string &rOut_) {
+		for (auto m : mnemonics)
+			rOut_ += "%mnemonic " + string(m) + "\n";
+		rOut_ += "\n";
+	}
+
+	void writeMacros(string &rOut_, size_t first_, size_t step_) {
+		for (size_t i = first_; i < params.macros; i += step_) {
+			string paramList, sum;
+			for (size_t a = 0; a < params.macroArgs; a++) {
+				paramList += (a ? " a" : "a") + numToStr(a);
+				sum += "a" + numToStr(a) + " + ";
+			}
+			rOut_ += "%define global f" + numToStr(i) + (params.macroArgs ? "(" + paramList + ")" : "") + " ((" + sum + numToStr(i) + ") & 0x7f)\n";
+		}
+		rOut_ += "\n";
+	}
+
+	void writeLibraryContents(string &rOut_, size_t lib_, size_t libNum_) {
+		if (lib_ == 0) {
+			rOut_ += "%define global lo(x) (x & 0xff)\n";
+			rOut_ += "%define global hi(x) ((x >> 8) & 0xff)\n\n";
+		}
+		writeMacros(rOut_, lib_, libNum_);
+		if (lib_ == libNum_ - 1) writeMnemonics(rOut_);
+	}
+
+	void writeBody(string &rOut_) {
+		size_t labelSpacing = params.labels ? std::max<size_t>(params.lines / params.labels, 1) : 0;
+		size_t nextLabel = 0;
+
+		std::uniform_real_distribution<float> chance(0.f, 1.f);
+
+		for (size_t l = 0; l < params.lines;) {
+			if (labelSpacing && nextLabel < params.labels && l >= nextLabel * labelSpacing) {
+				rOut_ += "lbl" + numToStr(nextLabel++) + ":\n";
+				l++;
+			}
+			else if (chance(rng) < params.ifDensity) {
+				rOut_ += "%if (MODE == " + numToStr(rand(3)) + ")\n";
+				l += 1 + writeInstructions(rOut_, 1 + rand(3));
+				rOut_ += "%elif (MODE == " + numToStr(rand(3)) + ")\n";
+				l += 1 + writeInstructions(rOut_, 1 + rand(3));
+				rOut_ += "%else\n";
+				l += 1 + writeInstructions(rOut_, 1 + rand(3));
+				rOut_ += "%endif\n";
+				l++;
+			}
+			else l += writeInstructions(rOut_, 1);
+		}
+	}
+
+private:
+	const CorpusParams &params;
+	std::mt19937 rng;
+
+	size_t rand(size_t n_) { return n_ ? rng() % n_ : 0; }
+
+	string reg() { return "R" + numToStr(rand(16)); }
+
+	string macroCall() {
+		if (params.macros == 0) return numToStr(rand(100));
+
+		string call = "f" + numToStr(rand(params.macros));
+		if (params.macroArgs == 0) return call;
+
+		call += '(';
+		for (size_t a = 0; a < params.macroArgs; a++) call += (a ? " " : "") + numToStr(rand(10));
+		return call + ')';
+	}
+
+	size_t writeInstructions(string &rOut_, size_t num_) {
+		for (size_t i = 0; i < num_; i++) {
+			rOut_ += '\t';
+			switch (rand(params.labels ? 7 : 6)) {
+			case 0: rOut_ += "ldi " + reg() + ' ' + macroCall(); break;
+			case 1: rOut_ += "psh " + macroCall(); break;
+			case 2: rOut_ += "add " + reg() + ' ' + reg() + ' ' + reg(); break;
+			case 3: rOut_ += "mov " + reg() + ' ' + reg(); break;
+			case 4: rOut_ += "nop"; break;
+			case 5: rOut_ += "\"ab\""; break;
+			case 6: {
+				string label = "lbl" + numToStr(rand(params.labels));
+				rOut_ += "jmp lo(" + label + ") hi(" + label + ")";
+				break;
+			}
+			}
+			rOut_ += '\n';
+		}
+		return num_;
+	}
+};
+
+bool writeText(const string &path_, const string &text_) {
+	std::ofstream ofs(path_, std::ios::trunc | std::ios::binary);
+	if (!ofs.is_open()) return 0;
+	ofs.write(text_.data(), text_.size());
+	return ofs.good();
+}
+
+}
+
+string generateCorpus(const CorpusParams &params_, const string &dir_) {
+	CorpusWriter writer(params_);
+	string dir = dir_.empty() || dir_.back() == '/' ? dir_ : dir_ + '/';
+
+	string mainText;
+
+	if (params_.includeDepth == 0) {
+		writer.writeLibraryContents(mainText, 0, 1);
+	}
+	else {
+		for (size_t lib = 0; lib < params_.includeDepth; lib++) {
+			string libName = "lib" + numToStr(lib);
+			string text = "%if (!" + libName + "_def)\n%define global " + libName + "_def 1\n\n";
+
+			if (lib + 1 < params_.includeDepth) text += "%include \"lib" + numToStr(lib + 1) + ".sba\"\n\n";
+			writer.writeLibraryContents(text, lib, params_.includeDepth);
+
+			text += "%endif\n";
+			if (!writeText(dir + libName + ".sba", text)) return "";
+		}
+
+		mainText += "%include \"lib0.sba\"\n";
+		mainText += "%include \"lib0.sba\"\n\n"; // Second include is closed by the guard
+	}
+
+	mainText += "%define global MODE 1\n\n";
+	writer.writeBody(mainText);
+
+	string mainPath = dir + "main.sba";
+	if (!writeText(mainPath, mainText)) return "";
+	return mainPath;
+}
\ No newline at end of file
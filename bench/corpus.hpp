@@ -0,0 +1,21 @@
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+#include "common.hpp"
+
+// Shape of a generated program. The layout follows tachyon2.sba and lta15p_utils.sba:
+// guarded libraries, %mnemonic definitions and function-like macros.
+struct CorpusParams {
+	size_t lines = 10000;		// Lines of code in the main file
+	size_t includeDepth = 3;	// Chain of libraries, each including the next one
+	size_t macros = 64;			// Function-like global macros
+	size_t macroArgs = 2;		// Parameters of every macro
+	size_t labels = 256;		// Labels in the main file, every one of them is jumped to
+	float ifDensity = 0.1f;		// Chance that a line starts an %if/%else block
+	unsigned int seed = 1;
+};
+
+// Writes the corpus into dir_ (which must exist) and returns the path of the main file
+string generateCorpus(const CorpusParams &params_, const string &dir_);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,31 @@
+#ifndef ARGUMENTS_HPP
+#define ARGUMENTS_HPP
+
+#include "common.hpp"
+
+struct CommandArguments {
+	vector<string> args;
+	unordered_map<string, string> longFlags;
+	bool shortFlags[256]{};
+
+	void parse(int argc, char* argv[]) {
+		for (int i = 0; i < argc; i++) {
+			if (argv[i][0] == '-') {
+				if (argv[i][1] == '-') { // --x=v or --x
+					char *eq = strchr(argv[i] + 2, '=');
+					if (eq) longFlags[string(argv[i] + 2, eq)] = string(eq + 1);
+					else longFlags[string(argv[i] + 2)] = "";
+				}
+				else for (int c = 1; argv[i][c] != '\0'; c++) {
+					if ((argv[i][c] >= 'a' && argv[i][c] <= 'z') || (argv[i][c] >= 'A' && argv[i][c] <= 'Z'))
+						shortFlags[argv[i][c]] = true;
+				}
+			}
+			else {
+				args.push_back(argv[i]);
+			}
+		}
+	}
+};
+
+#endif
\ No newline at end of file
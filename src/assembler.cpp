@@ -1,15 +1,20 @@
 #include "assembler.hpp"
 
-static void replaceLabels(Expression &rExpr_, const unordered_map<string, unsigned int> &labels_) {
+// Returns 1 if a label was replaced. Lists containing one have to be simplified again
+static bool replaceLabels(Expression &rExpr_, const unordered_map<Symbol, unsigned int> &labels_) {
 	if (rExpr_.type == Expression::Identifier) {
-		auto it = labels_.find(rExpr_.stringVal);
-		if (it != labels_.end())
-			rExpr_ = Expression((int)it->second);
-	}
-	else if (rExpr_.type == Expression::NestedExpression) {
-		for (auto &e : rExpr_.expressions)
-			replaceLabels(e, labels_);
+		auto it = labels_.find(rExpr_.symbol);
+		if (it == labels_.end()) return 0;
+		rExpr_ = Expression((int)it->second);
+		return 1;
 	}
+	if (rExpr_.type != Expression::NestedExpression) return 0;
+
+	bool replaced = 0;
+	for (auto &e : rExpr_.expressions)
+		replaced |= replaceLabels(e, labels_);
+	if (replaced) rExpr_.canonical = false;
+	return replaced;
 }
 
 static bool parseParam(const char *&rpStr_, const char *pLast_, vector<ParamTemplate> &rParams_, size_t &rLastParamBegin_) {
@@ -36,7 +41,7 @@ static bool parseParam(const char *&rpStr_, const char *pLast_, vector<ParamTemp
 	return 1;
 }
 
-static ErrorCode generateInstructionTemplate(const string &str_, InstructionTemplate &rTemplate_) {
+ErrorCode generateInstructionTemplate(const string &str_, InstructionTemplate &rTemplate_) {
 	if (str_.size() < 3 || str_[0] != '_') return InvalidInstruction;
 
 	const char *ptr = str_.data() + 1;
@@ -53,6 +58,14 @@ static ErrorCode generateInstructionTemplate(const string &str_, InstructionTemp
 		if (!rTemplate_.params.empty() && (rTemplate_.params.back().begin + rTemplate_.params.back().bits > rTemplate_.byteNum * 8)) return InstructionTooShort;
 	}
 
+	for (auto &p : rTemplate_.params) {
+		if (p.begin + p.bits > sizeof(InstructionBytes) * 8) return InvalidInstruction; // Bytes after the first 8 can only be empty
+
+		p.maxVal = (1LL << p.bits) - 1; // (1 << 8) - 1 = 255
+		p.minVal = p.type == Register ? 0 : -(1LL << p.bits) / 2; // -(1 << 8) / 2 = -128
+		p.shift = (int)(sizeof(InstructionBytes) * 8 - p.begin - p.bits);
+	}
+
 	return NoError;
 }
 
@@ -61,211 +74,434 @@ struct PreprInst {
 	vector<Expression> params;
 };
 
-static Result assembleInstruction(const InstructionTemplate &template_, const vector<Expression> &args_, InstructionBytes &rInst_) {
+// The first byte of the instruction is the highest byte of inst_
+static void writeInstruction(InstructionBytes inst_, size_t byteNum_, uint8_t *pOut_) {
+	for (size_t b = 0; b < byteNum_; b++)
+		pOut_[b] = b < sizeof(inst_) ? (uint8_t)(inst_ >> ((sizeof(inst_) - 1 - b) * 8)) : 0;
+}
+
+// line_[0] is the template, followed by the arguments
+static Result assembleInstruction(const InstructionTemplate &template_, const ExprList &line_, InstructionBytes &rInst_) {
 			
-	if (args_.size() != template_.params.size())
+	if (line_.size() - 1 != template_.params.size())
 		return { InvalidArgumentCount, numToStr(template_.params.size()) };
 	
 	InstructionBytes inst = 0;
 	
-	for (int i = 0; i < args_.size(); i++) {
-		
-		InstrucitonParam thisParam(args_[i]);
+	for (size_t i = 0; i < template_.params.size(); i++) {
+		const ParamTemplate &param = template_.params[i];
+		InstrucitonParam thisParam(line_[i + 1]);
 		
-		if (thisParam.type != template_.params[i].type) {
-			return { UnexpectedToken, args_[i].toString().stringVal };
+		if (thisParam.type != param.type) {
+			return { UnexpectedToken, line_[i + 1].toString().str() };
 		}
 				
-		int64_t maxVal = (1LL << template_.params[i].bits) - 1; // (1 << 8) - 1 = 255
-		int64_t minVal = template_.params[i].type == Register ? 0 : - (1LL << template_.params[i].bits) / 2; // -(1 << 8) / 2 = -128
-		if (thisParam.value < minVal || thisParam.value > maxVal) {
-			return { InvalidRange, '[' + numToStr(minVal) + ", " + numToStr(maxVal) + ']' };
+		if (thisParam.value < param.minVal || thisParam.value > param.maxVal) {
+			return { InvalidRange, '[' + numToStr(param.minVal) + ", " + numToStr(param.maxVal) + ']' };
 		}
 		
-		int offset = (int)sizeof(inst) * 8 - template_.params[i].begin - template_.params[i].bits;
-		
-		inst |= (thisParam.value & maxVal) << offset;
+		inst |= (thisParam.value & param.maxVal) << param.shift;
+	}
 
-		/*
-						   [****] line_[intVal].value
-			   [________________] inst
+	rInst_ = inst;
 
-		  [****]                  line_[intVal].value >>= -(sizeof(inst) * 8)
-			   [________________] inst
+	return {};
+}
+
+static bool containsIdentifier(const Expression &expr_) {
+	if (expr_.type == Expression::Identifier) return 1;
+	if (expr_.type == Expression::NestedExpression)
+		for (auto &e : expr_.expressions)
+			if (containsIdentifier(e)) return 1;
+	return 0;
+}
 
-			   [****]             line_[intVal].value >>= params[intVal].bits
-			   [________________] inst
+static void collectIdentifiers(const Expression &expr_, vector<Symbol> &rSymbols_) {
+	if (expr_.type == Expression::Identifier) rSymbols_.push_back(expr_.symbol);
+	for (auto &e : expr_.expressions) collectIdentifiers(e, rSymbols_);
+}
 
-					 [****]       line_[intVal].value >>= params[intVal].begin
-			   [________________] inst
-		*/
+// Labels defined later can't change the instruction: its arguments have no identifiers other than registers in register fields
+static bool isResolved(const InstructionTemplate &template_, const ExprList &line_) {
+	for (size_t i = 1; i < line_.size(); i++) {
+		if (line_[i].type == Expression::Identifier) {
+			if (i > template_.params.size() || template_.params[i - 1].type != Register || InstrucitonParam(line_[i]).type != Register) return 0;
+		}
+		else if (containsIdentifier(line_[i])) return 0;
 	}
-	
-	inst >>= ((int)sizeof(inst) - template_.byteNum) * 8;
+	return 1;
+}
 
-	rInst_ = inst;
+// The arguments must have their labels replaced already
+static Result encodeInstruction(const InstructionTemplate &template_, ExprList &rLine_, InstructionBytes &rInst_) {
+	for (int i = 1; i < rLine_.size(); i++) {
+		rLine_[i].simplify(); // <-- the result isn't checked because registers can't be simplified, and simplify() returns 0 when it encounters one.
+		if (rLine_[i].type != Expression::Identifier && rLine_[i].type != Expression::Integer)
+			return { UnexpectedToken, rLine_[i].toString().str() };
+	}
 
-	return {};
+	return assembleInstruction(template_, rLine_, rInst_);
 }
 
-Result assembleCode(vector<Expression> &rScript_, vector<Instruction> &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, vector<ProcessedFile> &rFileStack_, int &rInstructionCount_) {
-	Result result = {};
-	
-	ProcessedFile mainFile = rFileStack_.front();
+static bool isLabelLine(const ExprList &line_) {
+	return line_.size() == 2 && line_[1].type == Expression::Invalid && line_[1].str() == ":"; // : is not an operator, so it will be Expression::Invalid. but it will work
+}
 
-	vector<InstructionTemplate> templs;
+// Encodes the fixups on threads_ threads. Workers take chunks of consecutive fixups and skip lines after the earliest error found so far.
+// Lines with nested arguments are copied before they are changed, since freeing their nodes would go to the main thread's arena.
+// Leaf arguments have no nodes, so those lines are encoded in place.
+static EncodingError encodeParallel(deque<Fixup> &rFixups_, const vector<InstructionTemplate> &encoders_, const unordered_map<Symbol, unsigned int> &labels_, int errorLine_, unsigned int threads_, CodeImage &rCode_) {
+	constexpr size_t chunkSize = 1024;
+	size_t chunkNum = (rFixups_.size() + chunkSize - 1) / chunkSize;
+
+	std::atomic<size_t> nextChunk = 0;
+	std::atomic<int> errorBound = errorLine_ < 0 ? INT_MAX : errorLine_;
+	vector<EncodingError> chunkErrors(chunkNum);
+
+	auto work = [&]() {
+		for (size_t c; (c = nextChunk++) < chunkNum;) {
+			size_t end = std::min(rFixups_.size(), (c + 1) * chunkSize);
+
+			for (size_t f = c * chunkSize; f < end; f++) {
+				Fixup &fixup = rFixups_[f];
+				if (fixup.line > errorBound.load(std::memory_order_relaxed)) break;
+
+				Expression &line = fixup.instruction;
+				bool hasNested = std::any_of(line.expressions.begin() + 1, line.expressions.end(), [](const Expression &e_) { return e_.type == Expression::NestedExpression; });
+
+				const InstructionTemplate &templ = encoders_[fixup.encoder];
+				InstructionBytes inst = 0;
+				Result err;
+				if (hasNested) {
+					Expression copy = line;
+					replaceLabels(copy, labels_);
+					err = encodeInstruction(templ, copy.expressions, inst);
+				}
+				else {
+					replaceLabels(line, labels_);
+					err = encodeInstruction(templ, line.expressions, inst);
+				}
+				writeInstruction(inst, templ.byteNum, rCode_.bytes.data() + fixup.offset); // Instructions don't share bytes, so the threads write to separate memory
+				if (err.code != NoError) {
+					chunkErrors[c] = { fixup.line, std::move(err) };
 
-	unordered_map<string, unsigned int> labels;
-	
-	int processedBytes = 0;
-	for (int l = 0; l < rScript_.size(); l++, rFileStack_.back().line++) { // Get all label addresses (and templates bc why not)
+					int bound = errorBound.load();
+					while (fixup.line < bound && !errorBound.compare_exchange_weak(bound, fixup.line));
+					break;
+				}
+			}
+		}
+	};
 
-		vector<Expression> &line = rScript_[l].expressions;
+	symbols.setShared(true);
 
-		if (line.empty()) continue;
-		
-		if (line[0].type == Expression::Identifier) {
+	vector<std::thread> workers;
+	for (unsigned int t = 1; t < std::min<size_t>(threads_, chunkNum); t++) workers.emplace_back(work);
+	work();
+	for (auto &w : workers) w.join();
+
+	symbols.setShared(false);
+
+	EncodingError first;
+	for (auto &e : chunkErrors)
+		if (e.line >= 0 && (first.line < 0 || e.line < first.line)) first = std::move(e);
+	return first;
+}
+
+Assembler::Assembler(CodeImage &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, const ProcessedFile &mainFile_, unsigned int threads_, bool streaming_)
+	: code(rCode_), markers(rMarkers_), addMarkers(addMarkers_), threads(streaming_ ? 1 : threads_), streaming(streaming_), mainFile(mainFile_), currentFiles{ mainFile_ } {}
 
-			const string &command = line[0].stringVal;
-			if (command == "%file_push") {
-				rFileStack_.push_back({ line[1].stringVal, -1 });
+Result Assembler::add(Expression &rLine_) {
+	Result result = addLine(rLine_);
+	if (result.code != NoError) return result; // The file stack stays at the line
+
+	lineIdx++;
+	currentFiles.back().line++;
+	return {};
+}
+
+Result Assembler::addLine(Expression &rLine_) {
+	const int l = lineIdx;
+	ExprList &line = rLine_.expressions;
+
+	if (line.empty()) return {};
+
+	bool encoding = firstError.line < 0; // Lines after an encoding error are only checked for layout errors
+
+	if (line[0].type == Expression::Identifier) {
+
+		const string &command = line[0].str();
+		DirectiveEnum directive = getDirectiveEnum(command);
+		if (directive == DirFilePush) {
+			currentFiles.push_back({ line[1].str(), -1 });
+			fileEvents.push_back({ l, true, line[1].str() });
+		}
+		else if (directive == DirFilePop) {
+			if (currentFiles.size() > 1) currentFiles.pop_back();
+			fileEvents.push_back({ l, false });
+		}
+		else if (directive == DirSkipTo) { // %skip_to <byte>
+			if (line.size() != 2) {
+				return { InvalidArgumentCount, "1" };
 			}
-			else if (command == "%file_pop") {
-				if (rFileStack_.size() > 1) rFileStack_.pop_back();
+
+			if (line[1].type != Expression::Integer)
+				return { UnexpectedToken, line[1].toString().str() };
+
+			if (line[1].intVal < processedBytes)
+				return { InvalidRange, ">=" + numToStr(processedBytes)};
+
+			if (encoding) code.skipTo(line[1].intVal);
+
+			processedBytes = line[1].intVal;
+		}
+		else if (directive == DirAlign) { // %align <num_of_bytes>
+			if (line.size() != 2) {
+				return { InvalidArgumentCount, "1" };
 			}
-			else if (command == "%skip_to") { // %skip_to <byte>
-				if (line.size() != 2) {
-					return { InvalidArgumentCount, "1" };
-				}
 
-				if (line[1].type != Expression::Integer)
-					return { UnexpectedToken, line[1].toString().stringVal };
+			if (line[1].type != Expression::Integer)
+				return { UnexpectedToken, line[1].toString().str() };
+
+			if (line[1].intVal <= 0)
+				return { InvalidRange, ">0" };
 
-				if (line[1].intVal < processedBytes)
-					return { InvalidRange, ">=" + numToStr(processedBytes)};
+			int nextMultiple = ((line[1].intVal - processedBytes) % line[1].intVal);
+			if (nextMultiple < 0) nextMultiple += line[1].intVal; // a%b can be < 0 for some reason, so we need to add b again
+			nextMultiple += processedBytes;
 
-				processedBytes = line[1].intVal;
+			if (encoding) code.skipTo(nextMultiple);
+
+			processedBytes = nextMultiple;
+		}
+		else if (isLabelLine(line)) {
+			const string &labelName = line[0].str();
+			if (!isNameValid(labelName))
+				return { UnexpectedToken, labelName };
+
+			Symbol label = line[0].symbol;
+			if (!labels.emplace(label, processedBytes).second)
+				return { MultipleLabelDefinitions, labelName };
+
+			if (InstrucitonParam(line[0]).type == Register && label < firstRegisterUse.size() && firstRegisterUse[label] >= 0) { // Earlier lines used it as a register
+				if (shadowedLine < 0 || firstRegisterUse[label] < shadowedLine) shadowedLine = firstRegisterUse[label];
 			}
-			else if (command == "%align") { // %align <num_of_bytes>
-				if (line.size() != 2) {
-					return { InvalidArgumentCount, "1" };
-				}
 
-				if (line[1].type != Expression::Integer)
-					return { UnexpectedToken, line[1].toString().stringVal };
+			if (streaming) resolveFixups(label);
+		}
+		else if (directive == DirMarker) {
+			if (line.size() != 2) setEncodingError({ InvalidArgumentCount, "1" }, l);
+			else if (addMarkers && encoding) markers.push_back({ line[1].str(), code.size(), currentFiles });
+		}
+		else if (command.front() == '_') {
+
+			for (int i = 1; i < line.size(); i++) line[i].simplify();
 
-				int nextMultiple = ((line[1].intVal - processedBytes) % line[1].intVal);
-				if (nextMultiple < 0) nextMultiple += line[1].intVal; // a%b can be < 0 for some reason, so we need to add b again
-				nextMultiple += processedBytes;
-				
-				processedBytes = nextMultiple;
+			auto [id, inserted] = encoderIds.try_emplace(line[0].symbol, (uint32_t)encoders.size());
+			if (inserted) {
+				InstructionTemplate newInstTempl;
+				if (ErrorCode err = generateInstructionTemplate(command, newInstTempl))
+					return { err, command };
+				encoders.push_back(std::move(newInstTempl));
 			}
-			else {
-				if (line.size() == 2 && line[1].type == Expression::Invalid && line[1].stringVal == ":") { // : is not an operator, so it will be Expression::Invalid. but it will work
-					const string &labelName = line[0].stringVal;
-					if (!isNameValid(labelName))
-						return { UnexpectedToken, labelName };
-
-					auto it = labels.find(labelName);
-					if (it == labels.end())
-						labels.emplace(labelName, processedBytes);
-					else
-						return { MultipleLabelDefinitions, labelName };
+			const InstructionTemplate &templ = encoders[id->second];
 
-				}
-				else if (line[0].stringVal.front() == '_') {
+			if (encoding) {
+				replaceLabels(rLine_, labels);
+				addRegisterUses(templ, line, l);
 
-					for (int i = 1; i < line.size(); i++) line[i].simplify();
-					
-					InstructionTemplate newInstTempl;
-					if (ErrorCode err = generateInstructionTemplate(line[0].stringVal, newInstTempl))
-						return { err, line[0].stringVal };
+				size_t offset = code.bytes.size();
+				code.bytes.resize(offset + templ.byteNum);
+				code.instructions.push_back({ (uint32_t)processedBytes, (uint32_t)templ.byteNum });
 
-					processedBytes += newInstTempl.byteNum;
-					templs.push_back(newInstTempl);
+				InstructionBytes newInst = 0;
+				if (threads > 1 || !isResolved(templ, line)) {
+					fixups.push_back({ takenBytes + offset, l, id->second, std::move(rLine_) });
+					if (streaming) waitForLabels(templ);
+				}
+				else if (Result err = encodeInstruction(templ, line, newInst); err.code != NoError) {
+					setEncodingError(err, l);
 				}
+				else writeInstruction(newInst, templ.byteNum, code.bytes.data() + offset);
 			}
+
+			processedBytes += templ.byteNum;
+			instructionNum++;
 		}
-		else if (line[0].type == Expression::String && line.size() == 1) {
-			processedBytes += line[0].stringVal.size();
+	}
+	else if (line[0].type == Expression::String && line.size() == 1) {
+		if (encoding) code.bytes.insert(code.bytes.end(), line[0].str().begin(), line[0].str().end());
+		processedBytes += line[0].str().size();
+	}
+	else if (encoding) setEncodingError({ UnexpectedToken, line[0].toString().str() }, l);
+
+	return {};
+}
+
+Result Assembler::finish() {
+	if (threads > 1) {
+		EncodingError err = encodeParallel(fixups, encoders, labels, firstError.line, threads, code);
+		if (err.line >= 0) setEncodingError(err.result, err.line);
+	}
+	else {
+		for (auto &f : fixups) {
+			if (f.encoded) continue;
+			if (firstError.line >= 0 && f.line > firstError.line) break;
+
+			if (Result err = encodeFixup(f); err.code != NoError) setEncodingError(err, f.line);
+		}
+	}
+
+	if (shadowedLine >= 0) { // The register is a label now, so the line would be encoded with its address, which doesn't fit a register field
+		for (Symbol arg : registerArgs[shadowedLine]) {
+			auto label = labels.find(arg);
+			if (label == labels.end()) continue;
+
+			setEncodingError({ UnexpectedToken, Expression((int)label->second).toString().str() }, shadowedLine);
+			break;
 		}
 	}
 
-	rFileStack_.clear();
-	rFileStack_.push_back(mainFile);
+	if (firstError.line >= 0) {
+		rewindFileStack(firstError.line);
+		return firstError.result;
+	}
 
-	processedBytes = 0;
-	for (int l = 0, instIdx = 0; l < rScript_.size(); l++, rFileStack_.back().line++) {
+	fixups.clear();
+	return {};
+}
 
-		vector<Expression> &line = rScript_[l].expressions;
+size_t Assembler::finalBytes() const {
+	return fixups.empty() ? code.bytes.size() : fixups.front().offset - takenBytes;
+}
 
-		if (line.empty()) continue;
+void Assembler::takeCode(CodeImage &rPiece_, vector<Marker> &rMarkers_) {
+	size_t cut = finalBytes();
 
-		if (line[0].type == Expression::Identifier) {
+	vector<CodeSegment> &segments = code.segments;
+	size_t s = std::upper_bound(segments.begin(), segments.end(), cut, [](size_t c_, const CodeSegment &s_) { return c_ < s_.offset; }) - segments.begin() - 1;
+	size_t end = segments[s].address + cut - segments[s].offset; // Address after the piece, including a gap before the next segment
 
-			if (line.size() == 2 && line[1].type == Expression::Invalid && line[1].stringVal == ":") continue;
+	rPiece_.bytes.assign(code.bytes.begin(), code.bytes.begin() + cut);
+	code.bytes.erase(code.bytes.begin(), code.bytes.begin() + cut);
 
-			const string &command = line[0].stringVal;
-			if (command == "%file_push") {
-				rFileStack_.push_back({ line[1].stringVal, -1 });
-			}
-			else if (command == "%file_pop") {
-				if (rFileStack_.size() > 1) rFileStack_.pop_back();
-			}
-			else if (command == "%marker") {
-				if (line.size() != 2) return { InvalidArgumentCount, "1" };
-				if (addMarkers_) rMarkers_.push_back({ line[1].stringVal, rCode_.size() });
-			}
-			else if (command == "%skip_to") { // %skip_to <byte>
-				size_t addedBytes = line[1].intVal - processedBytes;
-				rCode_.reserve(rCode_.size() + addedBytes);
-				for (int i = 0; i < addedBytes; i++)
-					rCode_.push_back(Instruction{ 0x00, 1 });
+	rPiece_.segments.assign(segments.begin(), segments.begin() + s + 1);
+	segments.erase(segments.begin(), segments.begin() + s);
+	segments[0] = { end, 0 };
+	for (size_t i = 1; i < segments.size(); i++) segments[i].offset -= cut;
 
-				processedBytes = line[1].intVal;
-			}
-			else if (command == "%align") { // %align <num_of_bytes>
-				int nextMultiple = ((line[1].intVal - processedBytes) % line[1].intVal);
-				if (nextMultiple < 0) nextMultiple += line[1].intVal;
-				nextMultiple += processedBytes;
+	auto spanEnd = std::partition_point(code.instructions.begin(), code.instructions.end(), [&](const InstructionSpan &s_) { return s_.begin < end; });
+	rPiece_.instructions.assign(code.instructions.begin(), spanEnd);
+	code.instructions.erase(code.instructions.begin(), spanEnd);
 
-				size_t addedBytes = nextMultiple - processedBytes;
-				rCode_.reserve(rCode_.size() + addedBytes);
-				for (int i = 0; i < addedBytes; i++)
-					rCode_.push_back(Instruction{ 0x00, 1 });
+	auto markerEnd = std::partition_point(markers.begin(), markers.end(), [&](const Marker &m_) { return m_.pos < end; });
+	rMarkers_.assign(std::make_move_iterator(markers.begin()), std::make_move_iterator(markerEnd));
+	markers.erase(markers.begin(), markerEnd);
 
-				processedBytes += addedBytes;
-			}
-			else {
-				if (line[0].stringVal.front() == '_') {
-					replaceLabels(rScript_[l], labels);
-
-					for (int i = 1; i < line.size(); i++) {
-						line[i].simplify(); // <-- the result isn't checked because registers can't be simplified, and simplify() returns 0 when it encounters one.
-						if (line[i].type != Expression::Identifier && line[i].type != Expression::Integer)
-							return { UnexpectedToken, line[i].toString().stringVal };
-					}
-
-					InstructionBytes newInst;
-					result = assembleInstruction(templs[instIdx], vector<Expression>(line.begin() + 1, line.end()), newInst);
-					if (result.code != NoError) break;
-					rCode_.push_back({ newInst, templs[instIdx].byteNum });
-					
-					processedBytes += templs[instIdx].byteNum;
-					instIdx++;
-				}
-			}
-		}
-		else if (line[0].type == Expression::String && line.size() == 1) {
-			rCode_.reserve(rCode_.size() + line[0].stringVal.size());
-			for (uint8_t c : line[0].stringVal)
-				rCode_.push_back(Instruction{ c, 1 });
-			processedBytes += line[0].stringVal.size();
+	takenBytes += cut;
+}
+
+void Assembler::setEncodingError(const Result &err_, int line_) {
+	if (firstError.line < 0 || line_ < firstError.line) firstError = { line_, err_ };
+}
+
+// Remembers the first line using every register name in a register field, in case a label with the same name is defined later.
+// Only the earliest of those lines can be reported, so the others aren't kept
+void Assembler::addRegisterUses(const InstructionTemplate &template_, const ExprList &line_, int lineIdx_) {
+	bool firstUse = false;
+	for (size_t i = 1; i < line_.size() && i <= template_.params.size(); i++) {
+		if (template_.params[i - 1].type != Register || line_[i].type != Expression::Identifier) continue;
+
+		Symbol reg = line_[i].symbol;
+		if (reg >= firstRegisterUse.size()) firstRegisterUse.resize(reg + 1, -1);
+		if (firstRegisterUse[reg] < 0) {
+			firstRegisterUse[reg] = lineIdx_;
+			firstUse = true;
 		}
-		else return { UnexpectedToken, line[0].toString().stringVal };
 	}
 
-	rInstructionCount_ = templs.size();
+	if (!firstUse) return;
+
+	vector<Symbol> &args = registerArgs[lineIdx_];
+	for (size_t i = 1; i < line_.size() && i <= template_.params.size(); i++)
+		if (template_.params[i - 1].type == Register && line_[i].type == Expression::Identifier) args.push_back(line_[i].symbol);
+}
+
+// The last fixup is encoded once every label it uses is defined. Registers in register fields don't count, like in isResolved()
+void Assembler::waitForLabels(const InstructionTemplate &template_) {
+	Fixup &fixup = fixups.back();
+	const ExprList &line = fixup.instruction.expressions;
+
+	vector<Symbol> needed;
+	for (size_t i = 1; i < line.size(); i++) {
+		if (line[i].type == Expression::Identifier && i <= template_.params.size() && template_.params[i - 1].type == Register && InstrucitonParam(line[i]).type == Register) continue;
+		collectIdentifiers(line[i], needed);
+	}
+	std::sort(needed.begin(), needed.end());
+	needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+	for (Symbol label : needed) waitingFixups[label].push_back(firstFixup + fixups.size() - 1);
+	fixup.waiting = (int)needed.size();
+}
+
+void Assembler::resolveFixups(Symbol label_) {
+	auto waiting = waitingFixups.find(label_);
+	if (waiting == waitingFixups.end()) return;
+
+	for (size_t idx : waiting->second) {
+		Fixup &fixup = fixups[idx - firstFixup];
+		if (--fixup.waiting == 0) encodeFixup(fixup); // If it fails, finish() encodes it again and reports the error
+	}
+	waitingFixups.erase(waiting);
+
+	while (!fixups.empty() && fixups.front().encoded) {
+		fixups.pop_front();
+		firstFixup++;
+	}
+}
+
+Result Assembler::encodeFixup(Fixup &rFixup_) {
+	replaceLabels(rFixup_.instruction, labels);
+
+	const InstructionTemplate &templ = encoders[rFixup_.encoder];
+	InstructionBytes inst;
+	if (Result err = encodeInstruction(templ, rFixup_.instruction.expressions, inst); err.code != NoError) return err;
+
+	writeInstruction(inst, templ.byteNum, code.bytes.data() + rFixup_.offset - takenBytes);
+	rFixup_.encoded = true;
+	rFixup_.instruction = Expression();
+	return {};
+}
+
+// Rebuilds the file stack of line_, for errors reported after the line was passed
+void Assembler::rewindFileStack(int line_) {
+	currentFiles.clear();
+	currentFiles.push_back(mainFile);
+
+	int l = 0;
+	for (const FileEvent &e : fileEvents) {
+		if (e.line >= line_) break;
+
+		currentFiles.back().line += e.line - l;
+		if (e.push) currentFiles.push_back({ e.name, -1 });
+		else if (currentFiles.size() > 1) currentFiles.pop_back();
+
+		currentFiles.back().line++;
+		l = e.line + 1;
+	}
+	currentFiles.back().line += line_ - l;
+}
+
+Result assembleCode(vector<Expression> &rScript_, CodeImage &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, vector<ProcessedFile> &rFileStack_, int &rInstructionCount_, unsigned int threads_) {
+	Assembler assembler(rCode_, rMarkers_, addMarkers_, rFileStack_.front(), threads_);
+
+	Result result;
+	for (Expression &line : rScript_)
+		if ((result = assembler.add(line)).code != NoError) break;
+
+	if (result.code == NoError) result = assembler.finish();
 
+	rFileStack_ = assembler.fileStack();
+	rInstructionCount_ = assembler.instructionCount();
 	return result;
 }
\ No newline at end of file
@@ -11,8 +11,13 @@ struct ParamTemplate {
 	ParamType type;
 	size_t begin;
 	size_t bits;
+
+	// Computed once by generateInstructionTemplate()
+	int64_t minVal, maxVal; // maxVal is also the mask of the field
+	int shift; // Position of the field's lowest bit in the instruction
 };
 
+// Parsed once for every distinct template string and shared by all of its instruction lines
 struct InstructionTemplate {
 	size_t byteNum = 0;
 	vector<ParamTemplate> params;
@@ -36,12 +41,12 @@ struct InstrucitonParam {
 			value = (int64_t)expr_.floatVal;
 		}
 		else if (expr_.type == Expression::Identifier) {
-			if (!expr_.stringVal.empty()) {
-				if (expr_.stringVal[0] == 'R' || expr_.stringVal[0] == 'r') {
+			if (!expr_.str().empty()) {
+				if (expr_.str()[0] == 'R' || expr_.str()[0] == 'r') {
 					type = Register;
 
-					const char *begin = expr_.stringVal.data() + 1;
-					const char *end = expr_.stringVal.data() + expr_.stringVal.size();
+					const char *begin = expr_.str().data() + 1;
+					const char *end = expr_.str().data() + expr_.str().size();
 
 					auto result = std::from_chars(begin, end, value);
 					if (result.ec != std::errc{} || result.ptr != end) type = Invalid;
@@ -51,6 +56,87 @@ struct InstrucitonParam {
 	}
 };
 
-Result assembleCode(vector<Expression> &rScript_, vector<Instruction> &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, vector<ProcessedFile> &rFileStack_, int &rInstructionCount_);
+ErrorCode generateInstructionTemplate(const string &str_, InstructionTemplate &rTemplate_);
+
+struct Fixup { // Instruction using a label that wasn't defined yet (or any instruction, when encoding in parallel). It's encoded when its labels are known
+	size_t offset; // In the code image, counting the bytes taken out by Assembler::takeCode()
+	int line;
+	uint32_t encoder;
+	Expression instruction;
+	int waiting = 0; // Streaming: labels that aren't defined yet
+	bool encoded = false;
+};
+
+struct EncodingError {
+	int line = -1;
+	Result result;
+};
+
+// Assembles the script line by line. Instructions are encoded as soon as they are read, the ones referencing later labels get a placeholder and a fixup.
+// Errors of the layout (labels, templates, %skip_to, %align) are returned by add() right away,
+// encoding errors by finish(), the earliest one of them.
+class Assembler {
+public:
+	// With threads_ > 1 the fixups are encoded on that many threads by finish(), and every instruction is a fixup.
+	// With streaming_ a fixup is encoded on this thread as soon as its labels are defined, so the code before the first unresolved one can be taken out
+	Assembler(CodeImage &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, const ProcessedFile &mainFile_, unsigned int threads_ = 1, bool streaming_ = false);
+
+	Result add(Expression &rLine_); // The line may be moved from
+	Result finish(); // On an error, fileStack() is rebuilt for its line
+
+	const vector<ProcessedFile> &fileStack() const { return currentFiles; }
+	int instructionCount() const { return instructionNum; }
+
+	// Bytes at the start of the code image that can't change any more
+	size_t finalBytes() const;
+	// Moves them to rPiece_, with their instructions and markers. rPiece_ keeps the addresses of the whole image
+	void takeCode(CodeImage &rPiece_, vector<Marker> &rMarkers_);
+
+private:
+	struct FileEvent { // %file_push or %file_pop line
+		int line;
+		bool push;
+		string name;
+	};
+
+	CodeImage &code;
+	vector<Marker> &markers;
+	bool addMarkers;
+	unsigned int threads;
+	bool streaming;
+
+	ProcessedFile mainFile;
+	vector<ProcessedFile> currentFiles;
+	vector<FileEvent> fileEvents;
+
+	vector<InstructionTemplate> encoders;
+	unordered_map<Symbol, uint32_t> encoderIds; // Template string -> index in encoders
+	unordered_map<Symbol, unsigned int> labels;
+
+	deque<Fixup> fixups;
+	size_t firstFixup = 0; // Number of encoded fixups removed from the front
+	unordered_map<Symbol, vector<size_t>> waitingFixups; // Streaming: undefined label -> fixups using it
+	size_t takenBytes = 0;
+
+	vector<int> firstRegisterUse; // Indexed by Symbol: first line with the register name in a register field, -1 if none
+	unordered_map<int, vector<Symbol>> registerArgs; // Register arguments of those lines
+	int shadowedLine = -1; // First line using a register name that was defined as a label later
+
+	EncodingError firstError;
+	int lineIdx = 0;
+	int processedBytes = 0;
+	int instructionNum = 0;
+
+	Result addLine(Expression &rLine_);
+	void setEncodingError(const Result &err_, int line_);
+	void addRegisterUses(const InstructionTemplate &template_, const ExprList &line_, int lineIdx_);
+	void waitForLabels(const InstructionTemplate &template_);
+	void resolveFixups(Symbol label_);
+	Result encodeFixup(Fixup &rFixup_);
+	void rewindFileStack(int line_);
+};
+
+// With threads_ > 1 the instructions are encoded on that many threads once all labels are known
+Result assembleCode(vector<Expression> &rScript_, CodeImage &rCode_, vector<Marker> &rMarkers_, bool addMarkers_, vector<ProcessedFile> &rFileStack_, int &rInstructionCount_, unsigned int threads_ = 1);
 
 #endif
\ No newline at end of file
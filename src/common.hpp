@@ -2,22 +2,64 @@
 #define COMMON_HPP
 
 #include <stdio.h>
+#include <string.h>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <memory>
+#include <memory_resource>
 #include <charconv>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <shared_mutex>
 
 using std::vector;
 using std::string;
 using std::unordered_map;
+using std::unordered_set;
 using std::pair;
+using std::deque;
 
 using InstructionBytes = uint64_t;
 
-struct Instruction {
-	InstructionBytes bytes;
-	size_t byteNum;
+struct InstructionSpan {
+	uint32_t begin; // Address
+	uint32_t byteNum;
+};
+
+// Continuous part of the program. The memory between segments is filled with zeros
+struct CodeSegment {
+	size_t address;
+	size_t offset; // Index of the first byte in CodeImage::bytes
+};
+
+// Assembled program: instructions and data as a list of segments. Instructions are indexed as well, since -w output keeps their bytes together
+struct CodeImage {
+	vector<uint8_t> bytes; // Bytes of all segments, without the gaps
+	vector<CodeSegment> segments{ { 0, 0 } };
+	vector<InstructionSpan> instructions;
+
+	// Address after the last byte
+	size_t size() const { return segments.back().address + bytes.size() - segments.back().offset; }
+
+	// Moves the end of the image to address_ (>= size()) without storing the skipped bytes
+	void skipTo(size_t address_) {
+		if (address_ == size()) return;
+
+		if (segments.back().offset == bytes.size()) segments.back().address = address_; // Empty segment
+		else segments.push_back({ address_, bytes.size() });
+	}
 };
 
 inline int bitNum(uint64_t val_) {
@@ -2,7 +2,7 @@
 
 
 // %define ['global'] ['eval'] <macro>[([<params>...])] <value...>
-Result defineMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, MacroMap &rLocalMacros_, MacroRefMap &rMacroRefMap_) {
+Result defineMacro(const ExprList &line_, MacroTable &rMacros_) {
 
 	if (line_.size() < 3) return { InvalidArgumentCount, "2 or more" };
 
@@ -19,14 +19,14 @@ Result defineMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, Ma
 			const Expression &thisExpr = line_[1 + offset];
 
 			if (thisExpr.type == Expression::Identifier) {
-				if (thisExpr.stringVal == "global") {
-					if (global) return { UnexpectedToken, thisExpr.stringVal };
+				if (thisExpr.str() == "global") {
+					if (global) return { UnexpectedToken, thisExpr.str() };
 					global = true;
 					allKeywordsFound = false;
 					offset++;
 				}
-				else if (thisExpr.stringVal == "eval") {
-					if (evaluate) return { UnexpectedToken, thisExpr.stringVal };
+				else if (thisExpr.str() == "eval") {
+					if (evaluate) return { UnexpectedToken, thisExpr.str() };
 					evaluate = true;
 					allKeywordsFound = false;
 					offset++;
@@ -42,7 +42,7 @@ Result defineMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, Ma
 	// For cases like   (id "macroName")  --->  (macroName)
 	// Identifiers in brackets are not simplified by the simplify() function
 
-	if (macroName.type != Expression::Identifier) return { UnexpectedToken, macroName.toString().stringVal };
+	if (macroName.type != Expression::Identifier) return { UnexpectedToken, macroName.toString().str() };
 
 	bool hasParams = line_.size() > 2 + offset && line_[2 + offset].type == Expression::NestedExpression;
 	if (hasParams) {
@@ -54,31 +54,28 @@ Result defineMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, Ma
 	}
 	offset += hasParams;
 
-	Expression macro;
-	macro.type = Expression::NestedExpression;
-	macro.expressions.push_back({ vector<Expression>(line_.begin() + 2 + offset, line_.end()) });
-	if (hasParams) macro.expressions.push_back(line_[2 + offset - 1]);
+	Macro macro(Expression(ExprList(line_.begin() + 2 + offset, line_.end())));
+	if (hasParams)
+		for (auto &e : line_[2 + offset - 1].expressions) macro.params.push_back(e.symbol);
 
 	if (evaluate) {
-		Result err = macro.expressions[0].replaceMacros(rMacroRefMap_);
+		Result err = macro.value.replaceMacros(rMacros_);
 		if (err.code != NoError) return err;
-		for (auto &e : macro.expressions[0].expressions) e.simplify();
+		for (auto &e : macro.value.expressions) e.simplify();
 	}
 
-	(global ? rGlobalMacros_ : rLocalMacros_)[macroName.stringVal] = macro;
-	genFinalMacroMap(rMacroRefMap_, rLocalMacros_, rGlobalMacros_); // Macro map is regenerated, in case there was a reallocation
-	// TODO // do this more efficiently
+	rMacros_.define(macroName.symbol, std::move(macro), global);
 
 	return {};
 }
 
 // %undef ['global'] <macro>
-Result undefMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, MacroMap &rLocalMacros_, MacroRefMap &rMacroRefMap_) {
+Result undefMacro(const ExprList &line_, MacroTable &rMacros_) {
 
 	if (line_.size() < 2)
 		return { InvalidArgumentCount, "1 or 2" };
 
-	bool global = line_[1].type == Expression::Identifier && line_[1].stringVal == "global";
+	bool global = line_[1].type == Expression::Identifier && line_[1].str() == "global";
 
 	if (global && line_.size() != 2)
 		return { InvalidArgumentCount, "1 or 2" };
@@ -87,42 +84,126 @@ Result undefMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, Mac
 
 	flattenNestedExpr(macroName);
 
-	if (macroName.type != Expression::Identifier) return { UnexpectedToken, macroName.toString().stringVal };
+	if (macroName.type != Expression::Identifier) return { UnexpectedToken, macroName.toString().str() };
 
-	(global ? rGlobalMacros_ : rLocalMacros_).erase(macroName.stringVal);
-	
-	genFinalMacroMap(rMacroRefMap_, rLocalMacros_, rGlobalMacros_);
+	rMacros_.undef(macroName.symbol, global);
 
 	return {};
 }
 
+static DirectiveEnum getLineDirective(const Expression &line_) {
+	if (line_.expressions.empty() || line_.expressions[0].type != Expression::Identifier) return InvalidDirective;
+	return getDirectiveEnum(line_.expressions[0].str());
+}
+
+// Skips the rest of a conditional branch, starting after the current line.
+// Stops at the %endif, or at the next %elif/%else if toEndif_ is false. %endif and %else lines are consumed, %elif is left to be read next.
+// Returns the directive it stopped at, or InvalidDirective if the script ended first.
+static DirectiveEnum skipBranch(ScriptCursor &rCursor_, bool toEndif_, int &rSkippedLines_) {
+	
+	if (const ScriptBody *body = rCursor_.currentBody()) { // The block table only works inside one body
+		size_t target = body->nextBranch[rCursor_.currentIndex()];
+		while (target != ScriptBody::NoBranch && toEndif_ && getLineDirective(body->lines[target]) != DirEndif)
+			target = body->nextBranch[target];
+
+		if (target != ScriptBody::NoBranch) {
+			rSkippedLines_ += target - rCursor_.currentIndex() - 1;
+			rCursor_.skipTo(target);
+
+			DirectiveEnum directive = getLineDirective(body->lines[target]);
+			if (directive != DirElif) {
+				rCursor_.next();
+				rSkippedLines_++;
+			}
+			return directive;
+		}
+	}
+
+	// Unclosed in this body. The block may end in one of the files below
+	int loopDepth = 1;
+	while (rCursor_.next()) {
+
+		Expression &skipped = rCursor_.current();
+		DirectiveEnum directive = getLineDirective(skipped);
+		if (directive == InvalidDirective && (skipped.expressions.empty() || skipped.expressions[0].type != Expression::Identifier)) {
+			rSkippedLines_++;
+			continue;
+		}
+
+		if (directive == DirIf) loopDepth++;
+		else if (directive == DirEndif) loopDepth--;
+
+		if (loopDepth == 0) {
+			rSkippedLines_++;
+			return DirEndif;
+		}
+
+		if (loopDepth == 1 && !toEndif_) {
+			if (directive == DirElif) {
+				rCursor_.unread();
+				return DirElif;
+			}
+			if (directive == DirElse) {
+				rSkippedLines_++;
+				return DirElse;
+			}
+		}
+
+		rSkippedLines_++;
+		skipped.expressions.clear(); // Since other modules don't process %if commands the lines are removed.
+	}
+
+	return InvalidDirective;
+}
+
 // %if <cond>
-Result ifCondition(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, int &rLocalLineIdx_, const MacroRefMap &macroRefMap_) {
+// If <cond> is false, jumps to the next %elif, %else or %endif. An %elif reached this way sets rElifPending_, so it's evaluated.
+Result ifCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_, const MacroTable &macros_, bool &rElifPending_) {
 
 	if (line_.size() != 2) return { InvalidArgumentCount, "1" };
 
 	Expression cond = line_[1].toBool();
-	if (cond.type == Expression::Invalid) return { UnexpectedToken, line_[1].toString().stringVal };
+	if (cond.type == Expression::Invalid) return { UnexpectedToken, line_[1].toString().str() };
+
+	if (const ScriptBody *body = rCursor_.currentBody()) { // Reported whichever branch is taken
+		auto err = body->blockErrors.find((uint32_t)rCursor_.currentIndex());
+		if (err != body->blockErrors.end()) {
+			rLocalLineIdx_ += err->second.line - rCursor_.currentIndex();
+			return err->second.result;
+		}
+	}
+
 	if (cond.intVal != 0) return {};
 
-	int loopDepth = 1;
-	for (int fileEndIdx = rGlobalLineIdx_ + 1; fileEndIdx < rScript_.size(); fileEndIdx++) {
+	int skippedLines = 0;
+	DirectiveEnum directive = skipBranch(rCursor_, false, skippedLines);
+	if (directive == InvalidDirective) return { ClosingTokenNotFound, "%endif" };
 
-		if (!rScript_[fileEndIdx].expressions.empty() && rScript_[fileEndIdx].expressions[0].type == Expression::Identifier) {
-			if (rScript_[fileEndIdx].expressions[0].stringVal == "%if") loopDepth++;
-			else if (rScript_[fileEndIdx].expressions[0].stringVal == "%endif") loopDepth--;
+	rLocalLineIdx_ += skippedLines;
+	rElifPending_ = directive == DirElif;
+	return {};
+}
 
-			if (loopDepth == 0) {
-				rLocalLineIdx_ += fileEndIdx - rGlobalLineIdx_;
-				rGlobalLineIdx_ = fileEndIdx;
-				return {};
-			}
+// %elif <cond>
+Result elifCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_, const MacroTable &macros_, bool elifReached_, bool &rElifPending_) {
+	if (elifReached_) return ifCondition(line_, rCursor_, rLocalLineIdx_, macros_, rElifPending_);
 
-			rScript_[fileEndIdx].expressions.clear(); // Since other modules don't process %if commands the lines are removed.
-		}
-	}
+	// Reached after a processed branch
+	int skippedLines = 0;
+	if (skipBranch(rCursor_, true, skippedLines) == InvalidDirective) return { ClosingTokenNotFound, "%endif" };
+	rLocalLineIdx_ += skippedLines;
+	return {};
+}
+
+// %else
+Result elseCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_) {
+	if (line_.size() != 1) return { InvalidArgumentCount, "0" };
 
-	return { LabelUsedButNotDefined, line_[1].stringVal };
+	// A skipped branch never stops on %else, so a branch above was processed
+	int skippedLines = 0;
+	if (skipBranch(rCursor_, true, skippedLines) == InvalidDirective) return { ClosingTokenNotFound, "%endif" };
+	rLocalLineIdx_ += skippedLines;
+	return {};
 }
 
 static void makePathWhole(string &rPath_, const ProcessedFile &lastFile_) {
@@ -134,148 +215,299 @@ static void makePathWhole(string &rPath_, const ProcessedFile &lastFile_) {
 	rPath_ = fromRootDir ? rPath_ : lastFile_.location.path + rPath_;
 }
 
+static void collectIdentifiers(const Expression &expr_, vector<Symbol> &rSymbols_) {
+	if (expr_.type == Expression::Identifier) rSymbols_.push_back(expr_.symbol);
+	for (auto &e : expr_.expressions) collectIdentifiers(e, rSymbols_);
+}
+
+static IncludeGuard findIncludeGuard(const vector<Expression> &body_) {
+	IncludeGuard guard;
+
+	size_t l = 0;
+	while (l < body_.size() && body_[l].expressions.empty()) l++;
+
+	if (l == body_.size()) return guard;
+	const ExprList &ifLine = body_[l].expressions;
+	if (ifLine.size() != 2 || ifLine[0].type != Expression::Identifier || getDirectiveEnum(ifLine[0].str()) != DirIf) return guard;
+	size_t ifIdx = l;
+
+	int loopDepth = 1;
+	for (l++; l < body_.size() && loopDepth > 0; l++) {
+		const ExprList &line = body_[l].expressions;
+		if (line.empty()) continue;
+		if (line[0].type != Expression::Identifier) return guard; // ifCondition() doesn't remove these lines, so they would still be assembled
+
+		DirectiveEnum directive = getDirectiveEnum(line[0].str());
+		if (directive == DirIf) loopDepth++;
+		else if (directive == DirEndif) loopDepth--;
+		else if (loopDepth == 1 && (directive == DirElif || directive == DirElse)) return guard; // That branch would be processed
+	}
+	if (loopDepth != 0) return guard;
+
+	for (; l < body_.size(); l++)
+		if (!body_[l].expressions.empty()) return guard;
+
+	guard.ifLine = ifIdx;
+	collectIdentifiers(body_[ifIdx], guard.identifiers);
+	return guard;
+}
+
+static bool isFileMacro(const string &name_) { // Defined by %file_push, so they can't be resolved before the file is pushed
+	return strStartsWith(name_, "%arg") || name_ == "%path" || name_ == "%name";
+}
+
+// Evaluates the guard's %if line the same way the preprocessor would at the top of the included file.
+// Returns false when the file has to be included normally.
+static bool isGuardClosed(const SourceFile &file_, MacroTable &rMacros_) {
+	unordered_set<Symbol> visited;
+	vector<Symbol> pending = file_.guard.identifiers;
+	while (!pending.empty()) {
+		Symbol sym = pending.back();
+		pending.pop_back();
+
+		if (!visited.insert(sym).second) continue;
+		if (isFileMacro(symbols.name(sym))) return false;
+
+		if (const Macro *macro = rMacros_.findGlobal(sym)) {
+			collectIdentifiers(macro->value, pending);
+			pending.insert(pending.end(), macro->params.begin(), macro->params.end());
+		}
+	}
+
+	Expression line = file_.body->lines[file_.guard.ifLine];
+	line.expressions[0].simplify();
+
+	rMacros_.pushScope(); // Only global macros are visible, like in a freshly pushed file
+	Result err = line.replaceMacros(rMacros_);
+	rMacros_.popScope();
+	if (err.code != NoError) return false;
+
+	if (line.expressions.size() != 2 || line.expressions[0].type != Expression::Identifier || getDirectiveEnum(line.expressions[0].str()) != DirIf) return false;
+
+	line.expressions[1].simplify();
+	Expression cond = line.expressions[1].toBool();
+	return cond.type != Expression::Invalid && cond.intVal == 0;
+}
+
 // %include <"['/']path/filename"> [args...]
-Result includeFile(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, vector<ProcessedFile> &rFileStack_, unordered_map<string, vector<Expression>> &rFiles_) {
+Result includeFile(const ExprList &line_, ScriptCursor &rCursor_, vector<ProcessedFile> &rFileStack_, unordered_map<string, SourceFile> &rFiles_, const unordered_set<string> &onceFiles_, MacroTable &rMacros_) {
 	if (line_.size() < 2) return { InvalidArgumentCount, "1 or more" };
 
 	Expression fileName = line_[1];
 	fileName.simplify();
-	if (fileName.type != Expression::String) return { UnexpectedToken, line_[0].toString().stringVal };
+	if (fileName.type != Expression::String) return { UnexpectedToken, line_[0].toString().str() };
 
-	string &pathStr = fileName.stringVal;
+	string pathStr = fileName.str();
 	makePathWhole(pathStr, rFileStack_.back());
 
 	auto fileIt = rFiles_.find(pathStr); // We check if this file has been read before.
 	if (fileIt == rFiles_.end()) {
-		fileIt = rFiles_.emplace(pathStr, vector<Expression>()).first;
-		if (!readFile(fileIt->second, pathStr)) // If not, we read it from the folder
+		vector<Expression> script;
+		if (!readFile(script, pathStr, tokenCache)) // If not, we read it from the folder (or the token cache)
 			return { FileNotFound, pathStr };
-	}
 
-	const vector<Expression> &includedScript = fileIt->second;
+		IncludeGuard guard = findIncludeGuard(script);
+		fileIt = rFiles_.emplace(pathStr, SourceFile{ std::make_shared<const ScriptBody>(std::move(script)), std::move(guard) }).first;
+	}
 
-	{
-		Expression filePushLine(vector<Expression>{ Expression::makeIdentifier("%file_push"), Expression::makeString(pathStr) });
-		filePushLine.expressions.insert(filePushLine.expressions.end(), line_.begin() + 2, line_.end());
+	const SourceFile &file = fileIt->second;
 
-		rScript_[rGlobalLineIdx_] = filePushLine;
-		rScript_.insert(rScript_.begin() + rGlobalLineIdx_ + 1, includedScript.begin(), includedScript.end());
-		rScript_.insert(rScript_.begin() + rGlobalLineIdx_ + 1 + includedScript.size(), vector<Expression>{ Expression::makeIdentifier("%file_pop") });
+	if (onceFiles_.find(pathStr) != onceFiles_.end() || (file.guard.found() && isGuardClosed(file, rMacros_))) {
+		rCursor_.current().expressions.clear(); // Nothing of the file would be assembled. The arguments already had their macros replaced with the rest of the line
+		return {};
 	}
 
-	rGlobalLineIdx_--; // We go back one line, because the %inlcude at script[l] got replaced
+	Expression filePushLine(ExprList{ Expression::makeIdentifier("%file_push"), Expression::makeString(pathStr) });
+	filePushLine.expressions.insert(filePushLine.expressions.end(), line_.begin() + 2, line_.end());
+
+	rCursor_.include(file.body, std::move(filePushLine)); // The %include line is replaced, and %file_push is processed next
 
 	return {};
 }
 
 // Used for defining the contents of a file from inside another file. It makes libraries less messy.
 // %file_def <"['/']path/filename">
-Result defineFile(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, vector<ProcessedFile> &rFileStack_, unordered_map<string, vector<Expression>> &rFiles_) {
+Result defineFile(const ExprList &line_, ScriptCursor &rCursor_, vector<ProcessedFile> &rFileStack_, unordered_map<string, SourceFile> &rFiles_) {
 	if (line_.size() != 2) return { InvalidArgumentCount, "2" };
 
+	const string &pathName = line_[1].str(); // line_ is invalidated once the cursor moves
+	const string &errStr = line_[0].toString().str();
+
+	vector<Expression> &output = rCursor_.output;
+	size_t defIdx = output.size() - 1;
+
 	int loopDepth = 1;
-	for (int fileEndIdx = rGlobalLineIdx_ + 1; fileEndIdx < rScript_.size(); fileEndIdx++) {
+	while (rCursor_.next()) {
 
-		if (!rScript_[fileEndIdx].expressions.empty() && rScript_[fileEndIdx].expressions[0].type == Expression::Identifier) {
-			if (rScript_[fileEndIdx].expressions[0].stringVal == "%file_def") loopDepth++;
-			else if (rScript_[fileEndIdx].expressions[0].stringVal == "%file_end") loopDepth--;
+		const Expression &thisExpr = rCursor_.current();
+		if (!thisExpr.expressions.empty() && thisExpr.expressions[0].type == Expression::Identifier) {
+			DirectiveEnum directive = getDirectiveEnum(thisExpr.expressions[0].str());
+			if (directive == DirFileDef) loopDepth++;
+			else if (directive == DirFileEnd) loopDepth--;
 			
 			if (loopDepth == 0) {
-				string pathStr = line_[1].stringVal;
+				size_t fileEndIdx = output.size() - 1;
+
+				string pathStr = pathName;
 				makePathWhole(pathStr, rFileStack_.back());
-				rFiles_[pathStr] = vector<Expression>(rScript_.begin() + rGlobalLineIdx_ + 1, rScript_.begin() + fileEndIdx);
+				vector<Expression> body(output.begin() + defIdx + 1, output.begin() + fileEndIdx);
+				IncludeGuard guard = findIncludeGuard(body);
+				rFiles_[pathStr] = SourceFile{ std::make_shared<const ScriptBody>(std::move(body)), std::move(guard) };
 				
-				for (auto it = rScript_.begin() + rGlobalLineIdx_; it <= rScript_.begin() + fileEndIdx; it++) it->expressions.clear();
+				for (auto it = output.begin() + defIdx; it <= output.begin() + fileEndIdx; it++) it->expressions.clear();
 
-				rFileStack_.back().line += fileEndIdx - rGlobalLineIdx_; // TEST
-				rGlobalLineIdx_ = fileEndIdx;
+				rFileStack_.back().line += fileEndIdx - defIdx; // TEST
 				return {};
 			}
 		}
 	}
 
-	return { ClosingTokenNotFound, line_[0].toString().stringVal };
+	return { ClosingTokenNotFound, errStr };
 }
 
 // %file_push <path> [args...]
-Result pushFile(const vector<Expression> &line_, vector<ProcessedFile> &rFileStack_, const MacroMap &globalMacros_, MacroRefMap &rMacroMap_) {
+Result pushFile(const ExprList &line_, vector<ProcessedFile> &rFileStack_, MacroTable &rMacros_) {
 	if (line_.size() < 2) {
 		return { InvalidArgumentCount, "1 or more" };
 	}
 
 	ProcessedFile newFile;
 	newFile.line = -1; // We do l++ at the beginning of the next loop iteration
-	newFile.location = line_[1].stringVal;
-
-	for (size_t i = 2; i < line_.size(); i++) {
-		newFile.macros["%arg" + numToStr(i - 2)] = Expression(vector<Expression>{ Expression(vector<Expression>{ line_[i] }) });
-	}
-		
-	newFile.macros["%argn"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression((int)line_.size() - 2) }) }); // This looks ugly, but that's how macros are stored
-	newFile.macros["%path"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression::makeString(newFile.location.path) }) });
-	newFile.macros["%name"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression::makeString(newFile.location.name) }) });
+	newFile.location = line_[1].str();
 
 	rFileStack_.back().line--;
 	rFileStack_.push_back(newFile);
+	rMacros_.pushScope();
 
-	genFinalMacroMap(rMacroMap_, rFileStack_.back().macros, globalMacros_);
+	for (size_t i = 2; i < line_.size(); i++) {
+		rMacros_.define(symbols.intern("%arg" + numToStr(i - 2)), Expression(ExprList{ line_[i] }), false);
+	}
+		
+	rMacros_.define(symbols.intern("%argn"), Expression(ExprList{ Expression((int)line_.size() - 2) }), false);
+	rMacros_.define(symbols.intern("%path"), Expression(ExprList{ Expression::makeString(newFile.location.path) }), false);
+	rMacros_.define(symbols.intern("%name"), Expression(ExprList{ Expression::makeString(newFile.location.name) }), false);
 
 	return {};
 }
 
 // %inherit <'all'/macros...>
-Result inheritMacros(const vector<Expression> &line_, vector<ProcessedFile> &rFileStack_, const MacroMap &globalMacros_, MacroRefMap &rMacroMap_) {
+Result inheritMacros(const ExprList &line_, vector<ProcessedFile> &rFileStack_, MacroTable &rMacros_) {
 	if (line_.size() < 2) {
 		return { InvalidArgumentCount, "1 or more" };
 	}
 
-	if (rFileStack_.size() == 1) return { UnexpectedToken, line_[0].toString().stringVal };
+	if (rFileStack_.size() == 1) return { UnexpectedToken, line_[0].toString().str() };
 
-	const MacroMap &other = rFileStack_[rFileStack_.size() - 2].macros;
+	if (line_[1].type == Expression::Identifier && line_[1].str() == "all") {
+		if (line_.size() > 2) return { UnexpectedToken, line_[2].toString().str() };
 
-	if (line_[1].type == Expression::Identifier && line_[1].stringVal == "all") {
-		if (line_.size() > 2) return { UnexpectedToken, line_[2].toString().stringVal };
-
-		for (auto &[k, v] : other)
-			rFileStack_.back().macros[k] = v;
-		
+		rMacros_.inheritAll();
 		return {};
 	}
 
 	for (int i = 1; i < line_.size(); i++) {
-		if (line_[i].type != Expression::Identifier) return { UnexpectedToken, line_[i].toString().stringVal };
-
-		auto it = other.find(line_[i].stringVal);
-		if (it == other.end()) return { UnexpectedToken, line_[i].toString().stringVal };
+		if (line_[i].type != Expression::Identifier) return { UnexpectedToken, line_[i].toString().str() };
 
-		rFileStack_.back().macros[it->first] = it->second;
+		if (!rMacros_.inherit(line_[i].symbol)) return { UnexpectedToken, line_[i].toString().str() };
 	}
 
-	genFinalMacroMap(rMacroMap_, rFileStack_.back().macros, globalMacros_);
-
 	return {};
 }
 
 // %error [code] <text>
-Result errorDirective(const vector<Expression> &line_) {
+Result errorDirective(const ExprList &line_) {
 	if (line_.size() == 2) {
-		return { ErrorDirective, line_[1].toString().stringVal };
+		return { ErrorDirective, line_[1].toString().str() };
 	}
 	else if (line_.size() == 3) {
 
 		if (line_[1].type != Expression::Integer) {
-			return { UnexpectedToken, line_[1].toString().stringVal };
+			return { UnexpectedToken, line_[1].toString().str() };
 		}
 
 		if (line_[2].type != Expression::String) {
-			return { UnexpectedToken, line_[2].toString().stringVal };
+			return { UnexpectedToken, line_[2].toString().str() };
 		}
 
 		ErrorCode err = (ErrorCode)line_[1].intVal;
 		if (line_[1].intVal < 0 || line_[1].intVal >= ErrorCode_End) err = ErrorDirective;
-		return { err, line_[2].stringVal };
+		return { err, line_[2].str() };
 	}
 	else {
 		return { InvalidArgumentCount, "1 or 2" };
 	}
+}
+
+// %mnemonic <name>[(params...)] <template> [fields...]
+Result defineMnemonic(const ExprList &line_, MnemonicMap &rMnemonics_) {
+
+	if (line_.size() < 3) return { InvalidArgumentCount, "2 or more" };
+
+	Expression name = line_[1];
+	flattenNestedExpr(name);
+
+	if (name.type != Expression::Identifier || name.str().front() == '%' || name.str().front() == '_') return { UnexpectedToken, name.toString().str() };
+
+	bool hasParams = line_[2].type == Expression::NestedExpression;
+	if (hasParams) {
+		for (auto &e : line_[2].expressions)
+			if (e.type != Expression::Identifier) return { UnexpectedToken, e.toString().str() };
+	}
+
+	size_t templIdx = 2 + hasParams;
+	if (templIdx >= line_.size()) return { InvalidArgumentCount, "2 or more" };
+
+	const Expression &templ = line_[templIdx];
+	if (templ.type != Expression::Identifier) return { UnexpectedToken, templ.toString().str() };
+
+	// The template and the fields are checked here once, so a use of the mnemonic only has to count its arguments
+	InstructionTemplate instTempl;
+	if (ErrorCode err = generateInstructionTemplate(templ.str(), instTempl)) return { err, templ.str() };
+
+	size_t fieldNum = line_.size() - templIdx - 1;
+	if (fieldNum != instTempl.params.size()) return { InvalidArgumentCount, numToStr(instTempl.params.size()) };
+
+	Macro mnemonic(Expression(ExprList(line_.begin() + templIdx, line_.end())));
+	mnemonic.paramsShadowMacros = true;
+	if (hasParams)
+		for (auto &e : line_[2].expressions) mnemonic.params.push_back(e.symbol);
+
+	for (size_t f = 0; f < fieldNum; f++) {
+		const Expression &field = line_[templIdx + 1 + f];
+		if (field.type == Expression::Identifier && std::find(mnemonic.params.begin(), mnemonic.params.end(), field.symbol) != mnemonic.params.end()) continue;
+
+		InstrucitonParam param(field); // Literal fields, labels and macros are Invalid here and get checked by the assembler
+		if (param.type != ParamType::Invalid && param.type != instTempl.params[f].type) return { UnexpectedToken, field.toString().str() };
+	}
+
+	rMnemonics_.insert_or_assign(name.symbol, std::move(mnemonic));
+
+	return {};
+}
+
+// Replaces a line using a mnemonic with the mnemonic's instruction line
+Result expandMnemonic(Expression &rLine_, const Macro &mnemonic_, const MacroTable &macros_) {
+	ExprList &line = rLine_.expressions;
+
+	if (line.size() - 1 != mnemonic_.params.size()) return { InvalidArgumentCount, numToStr(mnemonic_.params.size()) };
+
+	const MacroExpansion *expansion;
+	{
+		Result err = mnemonic_.expand(macros_, expansion);
+		if (err.code != NoError) return err;
+	}
+
+	if (mnemonic_.params.empty()) {
+		line = expansion->instantiate();
+	}
+	else {
+		Expression args(std::move(line));
+		args.expressions.erase(args.expressions.begin()); // The mnemonic's name
+		line = expansion->instantiate(&args);
+	}
+
+	for (int e = 1; e < line.size(); e++)
+		line[e].simplify();
+
+	return {};
 }
\ No newline at end of file
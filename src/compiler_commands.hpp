@@ -4,14 +4,22 @@
 #include "common.hpp"
 #include "parser.hpp"
 #include "files.hpp"
+#include "assembler.hpp"
 
-Result defineMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, MacroMap &rLocalMacros_, MacroRefMap &rMacroRefMap_);
-Result undefMacro(const vector<Expression> &line_, MacroMap &rGlobalMacros_, MacroMap &rLocalMacros_, MacroRefMap &rMacroRefMap_);
-Result ifCondition(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, int &rLocalLineIdx_, const MacroRefMap &macroRefMap_);
-Result includeFile(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, vector<ProcessedFile> &rFileStack_, unordered_map<string, vector<Expression>> &rFiles_);
-Result defineFile(const vector<Expression> &line_, vector<Expression> &rScript_, int &rGlobalLineIdx_, vector<ProcessedFile> &rFileStack_, unordered_map<string, vector<Expression>> &rFiles_);
-Result pushFile(const vector<Expression> &line_, vector<ProcessedFile> &rFileStack_, const MacroMap &globalMacros_, MacroRefMap &rMacroMap_);
-Result inheritMacros(const vector<Expression> &line_, vector<ProcessedFile> &rFileStack_, const MacroMap &globalMacros_, MacroRefMap &rMacroMap_);
-Result errorDirective(const vector<Expression> &line_);
+// Encoding of every %mnemonic: its template followed by the fields, with the parameters of the mnemonic
+using MnemonicMap = unordered_map<Symbol, Macro>;
+
+Result defineMacro(const ExprList &line_, MacroTable &rMacros_);
+Result undefMacro(const ExprList &line_, MacroTable &rMacros_);
+Result ifCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_, const MacroTable &macros_, bool &rElifPending_);
+Result elifCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_, const MacroTable &macros_, bool elifReached_, bool &rElifPending_);
+Result elseCondition(const ExprList &line_, ScriptCursor &rCursor_, int &rLocalLineIdx_);
+Result includeFile(const ExprList &line_, ScriptCursor &rCursor_, vector<ProcessedFile> &rFileStack_, unordered_map<string, SourceFile> &rFiles_, const unordered_set<string> &onceFiles_, MacroTable &rMacros_);
+Result defineFile(const ExprList &line_, ScriptCursor &rCursor_, vector<ProcessedFile> &rFileStack_, unordered_map<string, SourceFile> &rFiles_);
+Result pushFile(const ExprList &line_, vector<ProcessedFile> &rFileStack_, MacroTable &rMacros_);
+Result inheritMacros(const ExprList &line_, vector<ProcessedFile> &rFileStack_, MacroTable &rMacros_);
+Result errorDirective(const ExprList &line_);
+Result defineMnemonic(const ExprList &line_, MnemonicMap &rMnemonics_);
+Result expandMnemonic(Expression &rLine_, const Macro &mnemonic_, const MacroTable &macros_);
 
 #endif
\ No newline at end of file
@@ -1,70 +1,908 @@
 #include "files.hpp"
 
-bool readFile(vector<Expression> &rTokScript_, const string &fileName_) {
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define SB_UASM_MMAP
+#endif
 
-	vector<string> script;
+#include <chrono>
+#include <filesystem>
+#include <random>
 
-	std::ifstream ifs(fileName_);
+static bool loadFile(ScriptBuffer &rScript_, const string &fileName_) {
+
+	std::ifstream ifs(fileName_, std::ios::binary | std::ios::ate);
 	if (!ifs.is_open()) return 0;
-	
-	std::string line;
-	while (std::getline(ifs, line))
-		script.push_back(line);
+
+	std::streamoff size = ifs.tellg();
+	if (size < 0) return 0;
+
+	ifs.seekg(0);
+	rScript_.text.resize(size);
+	if (!ifs.read(rScript_.text.data(), size)) return 0;
+
+	const char *text = rScript_.text.data();
+
+	rScript_.lines.reserve(std::count(text, text + size, '\n') + 1);
+
+	size_t begin = 0;
+	while (begin < size) {
+		const char *newLine = (const char *)memchr(text + begin, '\n', size - begin);
+
+		size_t end = newLine != nullptr ? newLine - text : size;
+		size_t next = end + 1;
+
+		if (end != begin && text[end - 1] == '\r') end--; // CRLF is treated like in text mode
+
+		rScript_.lines.push_back({ begin, end });
+		begin = next;
+	}
+
+	return 1;
+}
+
+bool readFile(vector<Expression> &rTokScript_, const string &fileName_, TokenCache *pCache_) {
+
+	ScriptBuffer script;
+	if (!loadFile(script, fileName_)) return 0;
+
+	if (pCache_ == nullptr) {
+		prepareScript(script);
+		tokenizeScript(script, rTokScript_);
+		return 1;
+	}
+
+	TokenCacheKey key(fileName_, script.text); // Before prepareScript() removes the comments in place
+	if (pCache_->load(key, rTokScript_)) return 1;
 
 	prepareScript(script);
 	tokenizeScript(script, rTokScript_);
+	pCache_->store(key, rTokScript_);
+
+	return 1;
+}
 
+bool ScriptReader::open(const string &fileName_) {
+	if (!loadFile(script, fileName_)) return 0;
+
+	prepareScript(script);
 	return 1;
 }
 
-bool saveCode(const vector<Instruction> &code_, const string &fileName_, size_t bytesPerLine_, bool splitInstructions_, const vector<Marker> &markers_, size_t *pByteNum_) {
+SharedBody ScriptReader::next() {
+	vector<Expression> lines;
+	lines.reserve(std::min(chunkLines, script.lines.size() - nextLine));
 
+	int depth = 0; // Counted like the ScriptBody constructor does
+	for (; nextLine < script.lines.size() && (lines.size() < chunkLines || depth > 0); nextLine++) {
+		const ScriptLine &l = script.lines[nextLine];
+		lines.push_back(Expression::parseLine(script.text.data() + l.begin, script.text.data() + l.end));
 
-	std::ofstream ofs(fileName_, std::ios::trunc | std::ios::binary);
-	if (!ofs.is_open()) return 0;
+		const ExprList &line = lines.back().expressions;
+		if (line.empty() || line[0].type != Expression::Identifier) continue;
+
+		DirectiveEnum directive = getDirectiveEnum(line[0].str());
+		if (directive == DirIf) depth++;
+		else if (directive == DirEndif && depth > 0) depth--;
+	}
+
+	return std::make_shared<const ScriptBody>(std::move(lines));
+}
+
+namespace {
+
+constexpr char tokenCacheMagic[8]{ 'S', 'B', 'U', 'A', 'S', 'M', 'T', '2' }; // The last character is the version of the format
+
+uint64_t fnv1a(std::string_view str_) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (char c : str_) {
+		hash ^= (uint8_t)c;
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+constexpr int maxTokenDepth = 256; // Deeper entries are treated as corrupted. Parentheses nest far less in real scripts
+
+// Entry layout, all numbers little-endian:
+//   magic, key (path length, path, size, mtime, hash), hash of the payload (everything after it),
+//   symbol table (count, then length and text of each),
+//   line count, then the nodes of every line in preorder: type, canonical, value (symbol index for text), child count
+class TokenWriter {
+public:
+	string data;
+
+	void put(uint64_t val_, int bytes_) {
+		for (int b = 0; b < bytes_; b++) data.push_back((char)(val_ >> (b * 8)));
+	}
+
+	void putStr(std::string_view str_) {
+		put(str_.size(), 4);
+		data += str_;
+	}
+
+	void putKey(const TokenCacheKey &key_) {
+		data.append(tokenCacheMagic, sizeof(tokenCacheMagic));
+		putStr(key_.path);
+		put(key_.size, 8);
+		put((uint64_t)key_.mtime, 8);
+		put(key_.hash, 8);
+
+		payloadPos = data.size() + 8;
+		put(0, 8); // Set by sealPayload()
+	}
+
+	void sealPayload() {
+		uint64_t hash = fnv1a(std::string_view(data).substr(payloadPos));
+		for (int b = 0; b < 8; b++) data[payloadPos - 8 + b] = (char)(hash >> (b * 8));
+	}
+
+	void putExpr(const Expression &expr_) {
+		put(expr_.type, 1);
+		put(expr_.canonical, 1);
+		put(value(expr_), 4);
+		put(expr_.expressions.size(), 4);
+		for (const Expression &e : expr_.expressions) putExpr(e);
+	}
+
+	void putSymbols() {
+		put(symbolList.size(), 4);
+		for (Symbol s : symbolList) putStr(symbols.name(s));
+	}
+
+	// Collects the text of all nodes first, since the symbol table comes before the lines
+	void collectSymbols(const Expression &expr_) {
+		if (expr_.hasText() && symbolIds.try_emplace(expr_.symbol, (uint32_t)symbolList.size()).second) symbolList.push_back(expr_.symbol);
+		for (const Expression &e : expr_.expressions) collectSymbols(e);
+	}
+
+private:
+	size_t payloadPos = 0;
+	unordered_map<Symbol, uint32_t> symbolIds;
+	vector<Symbol> symbolList;
+
+	uint32_t value(const Expression &expr_) const {
+		switch (expr_.type) {
+		case Expression::Integer: return (uint32_t)expr_.intVal;
+		case Expression::Float: {
+			uint32_t bits;
+			memcpy(&bits, &expr_.floatVal, sizeof(bits));
+			return bits;
+		}
+		case Expression::Operator: return (uint32_t)expr_.operVal;
+		case Expression::NestedExpression: return 0;
+		default: return symbolIds.at(expr_.symbol);
+		}
+	}
+};
+
+// Every read is checked, a truncated or corrupted entry is only a cache miss
+class TokenReader {
+public:
+	TokenReader(std::string_view data_) : data(data_) {}
+
+	bool get(uint64_t &rVal_, int bytes_) {
+		if (data.size() - pos < (size_t)bytes_) return 0;
+		rVal_ = 0;
+		for (int b = 0; b < bytes_; b++) rVal_ |= (uint64_t)(uint8_t)data[pos++] << (b * 8);
+		return 1;
+	}
+
+	bool getStr(std::string_view &rStr_) {
+		uint64_t len;
+		if (!get(len, 4) || data.size() - pos < len) return 0;
+		rStr_ = data.substr(pos, len);
+		pos += len;
+		return 1;
+	}
+
+	bool checkKey(const TokenCacheKey &key_) {
+		std::string_view path;
+		uint64_t size, mtime, hash;
+		if (data.compare(0, sizeof(tokenCacheMagic), std::string_view(tokenCacheMagic, sizeof(tokenCacheMagic))) != 0) return 0;
+		pos = sizeof(tokenCacheMagic);
+		return getStr(path) && get(size, 8) && get(mtime, 8) && get(hash, 8)
+			&& path == key_.path && size == key_.size && (int64_t)mtime == key_.mtime && hash == key_.hash;
+	}
+
+	// Checked before anything is read from the payload, so a damaged entry can't turn into different tokens
+	bool checkPayload() {
+		uint64_t hash;
+		return get(hash, 8) && hash == fnv1a(data.substr(pos));
+	}
 
-	vector<char> outStr;
+	bool getSymbols() {
+		uint64_t count;
+		if (!get(count, 4)) return 0;
+		symbolList.reserve(std::min<uint64_t>(count, data.size()));
+		for (uint64_t s = 0; s < count; s++) {
+			std::string_view str;
+			if (!getStr(str)) return 0;
+			symbolList.push_back(symbols.intern(str));
+		}
+		return 1;
+	}
 
-	size_t lastMarkerIdx = 0;
+	bool getExpr(Expression &rExpr_, int depth_ = 0) {
+		uint64_t type, canonical, val, childNum;
+		if (depth_ > maxTokenDepth) return 0;
+		if (!get(type, 1) || !get(canonical, 1) || !get(val, 4) || !get(childNum, 4) || type > Expression::Invalid) return 0;
 
-	int column = 0;
-	size_t byteNum = 0;
+		rExpr_.type = (Expression::Type)type;
+		rExpr_.canonical = canonical;
+		switch (rExpr_.type) {
+		case Expression::Integer: rExpr_.intVal = (int)(uint32_t)val; break;
+		case Expression::Float: {
+			uint32_t bits = (uint32_t)val;
+			memcpy(&rExpr_.floatVal, &bits, sizeof(bits));
+			break;
+		}
+		case Expression::Operator:
+			if (val >= InvalidOper) return 0;
+			rExpr_.operVal = (MathOperEnum)val;
+			break;
+		case Expression::NestedExpression: rExpr_.intVal = 0; break;
+		default:
+			if (val >= symbolList.size()) return 0;
+			rExpr_.symbol = symbolList[val];
+		}
 
-	for (size_t i = 0; i < code_.size(); i++) {
+		if (childNum > data.size() - pos) return 0; // Every node takes at least one byte
+		rExpr_.expressions.reserve(childNum);
+		for (uint64_t c = 0; c < childNum; c++) {
+			Expression child;
+			if (!getExpr(child, depth_ + 1)) return 0;
+			rExpr_.expressions.push_back(std::move(child));
+		}
+		return 1;
+	}
+
+	bool atEnd() const { return pos == data.size(); }
 
-		constexpr char hexDigits[] { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+private:
+	std::string_view data;
+	size_t pos = 0;
+	vector<Symbol> symbolList;
+};
+
+}
 
-		if (lastMarkerIdx != markers_.size() && i == markers_[lastMarkerIdx].pos) {
-			string str = "<" + markers_[lastMarkerIdx].str + "> ";
-			outStr.insert(outStr.end(), str.begin(), str.end());
-			lastMarkerIdx++;
+TokenCacheKey::TokenCacheKey(const string &fileName_, std::string_view source_) : size(source_.size()), hash(fnv1a(source_)) {
+	std::error_code ec;
+	path = std::filesystem::absolute(fileName_, ec).lexically_normal().string();
+	if (ec) path = fileName_;
+	mtime = std::filesystem::last_write_time(fileName_, ec).time_since_epoch().count();
+}
+
+string TokenCache::entryPath(const TokenCacheKey &key_) const {
+	char name[24];
+	snprintf(name, sizeof(name), "%016llx.tok", (unsigned long long)fnv1a(key_.path));
+	return (std::filesystem::path(dir) / name).string();
+}
+
+bool TokenCache::load(const TokenCacheKey &key_, vector<Expression> &rTokScript_) {
+	std::ifstream ifs(entryPath(key_), std::ios::binary | std::ios::ate);
+	std::streamoff size = ifs.is_open() ? (std::streamoff)ifs.tellg() : -1;
+
+	string data;
+	if (size > 0) {
+		data.resize(size);
+		ifs.seekg(0);
+		if (!ifs.read(data.data(), size)) data.clear();
+	}
+
+	TokenReader reader(data);
+	uint64_t lineNum;
+	if (!reader.checkKey(key_) || !reader.checkPayload() || !reader.getSymbols() || !reader.get(lineNum, 4) || lineNum > data.size()) {
+		misses++;
+		return 0;
+	}
+
+	vector<Expression> lines(lineNum);
+	for (auto &line : lines)
+		if (!reader.getExpr(line)) {
+			misses++;
+			return 0;
+		}
+
+	if (!reader.atEnd()) {
+		misses++;
+		return 0;
+	}
+
+	rTokScript_ = std::move(lines);
+	hits++;
+	return 1;
+}
+
+void TokenCache::store(const TokenCacheKey &key_, const vector<Expression> &tokScript_) {
+	TokenWriter writer;
+	writer.putKey(key_);
+
+	for (const Expression &line : tokScript_) writer.collectSymbols(line);
+	writer.putSymbols();
+
+	writer.put(tokScript_.size(), 4);
+	for (const Expression &line : tokScript_) writer.putExpr(line);
+	writer.sealPayload();
+
+	// A unique temporary name, then a rename over the entry: readers see either the old entry or the whole new one
+	string path = entryPath(key_);
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%016llx.tmp", (unsigned long long)(std::random_device{}() ^ std::chrono::steady_clock::now().time_since_epoch().count()));
+	string tmpPath = path + suffix;
+
+	{
+		std::ofstream ofs(tmpPath, std::ios::trunc | std::ios::binary);
+		if (!ofs.is_open()) return;
+		ofs.write(writer.data.data(), writer.data.size());
+		if (!ofs.good()) {
+			ofs.close();
+			std::error_code ec;
+			std::filesystem::remove(tmpPath, ec);
+			return;
 		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+	if (ec) std::filesystem::remove(tmpPath, ec);
+}
+
+ScriptBody::ScriptBody(vector<Expression> lines_) : lines(std::move(lines_)), nextBranch(lines.size(), NoBranch) {
+	struct OpenBlock {
+		uint32_t ifLine;
+		uint32_t lastBranch;
+		bool hasBranches = false; // %elif or %else
+		bool hasElse = false;
+	};
+	vector<OpenBlock> openBlocks;
+
+	auto setError = [&](const OpenBlock &block_, uint32_t line_, Result result_) {
+		blockErrors.try_emplace(block_.ifLine, BlockError{ line_, std::move(result_) }); // Only the first error of a block
+	};
+
+	for (uint32_t l = 0; l < lines.size(); l++) {
+		const ExprList &line = lines[l].expressions;
+		if (line.empty() || line[0].type != Expression::Identifier) continue;
+
+		DirectiveEnum directive = getDirectiveEnum(line[0].str());
+		switch (directive) {
+		case DirIf:
+			openBlocks.push_back({ l, l });
+			break;
+
+		case DirElif:
+		case DirElse: {
+			if (openBlocks.empty()) break;
+			OpenBlock &block = openBlocks.back();
+			if (block.hasElse) setError(block, l, { UnexpectedToken, line[0].str() }); // Nothing can follow %else but %endif
+
+			nextBranch[block.lastBranch] = l;
+			block.lastBranch = l;
+			block.hasBranches = true;
+			block.hasElse |= directive == DirElse;
+			break;
+		}
+
+		case DirEndif:
+			if (openBlocks.empty()) break;
+			nextBranch[openBlocks.back().lastBranch] = l;
+			openBlocks.pop_back();
+			break;
+		}
+	}
+
+	// Blocks without %elif and %else may still be closed by the file that included this one
+	for (const OpenBlock &block : openBlocks)
+		if (block.hasBranches) setError(block, block.ifLine, { ClosingTokenNotFound, "%endif" });
+}
+
+bool ScriptCursor::next() {
+	if (hasPendingLine) {
+		output.push_back(std::move(pendingLine));
+		hasPendingLine = false;
+		fromFrame = false;
+		return 1;
+	}
+
+	if (frames.empty()) return 0;
+
+	if (frames.size() == 1 && pMainReader != nullptr && frames[0].cursor == frames[0].body->lines.size() && !pMainReader->atEnd())
+		frames[0] = { pMainReader->next() };
+
+	IncludeFrame &frame = frames.back();
+	if (frame.cursor < frame.body->lines.size()) {
+		output.push_back(frame.body->lines[frame.cursor++]);
+		fromFrame = true;
+		return 1;
+	}
+
+	frames.pop_back();
+	if (frames.empty()) return 0;
+
+	output.push_back(Expression(ExprList{ Expression::makeIdentifier("%file_pop") }));
+	fromFrame = false;
+	return 1;
+}
+
+void ScriptCursor::unread() {
+	if (fromFrame) frames.back().cursor--;
+	else {
+		pendingLine = std::move(output.back());
+		hasPendingLine = true;
+	}
+	output.pop_back();
+}
+
+void ScriptCursor::include(SharedBody body_, Expression pushLine_) {
+	output.pop_back();
+	pendingLine = std::move(pushLine_);
+	hasPendingLine = true;
+	frames.push_back({ std::move(body_) });
+}
+
+void ScriptCursor::skipTo(size_t target_) {
+	IncludeFrame &frame = frames.back();
+	output.reserve(output.size() + target_ - frame.cursor);
+
+	for (; frame.cursor < target_; frame.cursor++) {
+		const Expression &line = frame.body->lines[frame.cursor];
+		if (!line.expressions.empty() && line.expressions[0].type == Expression::Identifier) output.push_back(Expression(ExprList{})); // Removed
+		else output.push_back(line);
+	}
+}
+
+// Two hex digits of every byte value
+static constexpr auto hexPairs = []() {
+	constexpr char hexDigits[] { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+	std::array<char, 512> pairs{};
+	for (int b = 0; b < 256; b++) {
+		pairs[b * 2] = hexDigits[b >> 4];
+		pairs[b * 2 + 1] = hexDigits[b & 0xF];
+	}
+	return pairs;
+}();
+
+// Reads the image by address, the gaps between segments read as zeros
+class ImageReader {
+public:
+	ImageReader(const CodeImage &code_, size_t address_) : code(code_) {
+		auto it = std::upper_bound(code.segments.begin(), code.segments.end(), address_, [](size_t a_, const CodeSegment &s_) { return a_ < s_.address; });
+		loadSegment(it == code.segments.begin() ? 0 : it - code.segments.begin() - 1); // Addresses before the first segment read as zeros as well
+	}
+
+	uint8_t operator[](size_t address_) {
+		while (address_ >= nextAddress) loadSegment(segment + 1);
+		size_t idx = address_ - address;
+		return idx < byteNum ? pData[idx] : 0x00;
+	}
+
+private:
+	const CodeImage &code;
+	size_t segment = 0;
+	size_t address = 0, byteNum = 0, nextAddress = 0;
+	const uint8_t *pData = nullptr;
+
+	void loadSegment(size_t segment_) {
+		segment = segment_;
+		const CodeSegment &s = code.segments[segment];
+		bool last = segment + 1 == code.segments.size();
+
+		address = s.address;
+		byteNum = (last ? code.bytes.size() : code.segments[segment + 1].offset) - s.offset;
+		nextAddress = last ? SIZE_MAX : code.segments[segment + 1].address;
+		pData = code.bytes.data() + s.offset;
+	}
+};
 
-		InstructionBytes inst = code_[i].bytes << (((int)sizeof(code_[i].bytes) - code_[i].byteNum) * 8);
-		for (int j = 0; j < code_[i].byteNum; j++) {
-			outStr.push_back(hexDigits[inst >> (sizeof(inst) * 8 - 4)]);
-			inst <<= 4;
-			outStr.push_back(hexDigits[inst >> (sizeof(inst) * 8 - 4)]);
-			inst <<= 4;
+struct HexChunk {
+	size_t begin, end; // Addresses
+	size_t outOffset;
+};
 
-			byteNum++;
-			column++;
+// Formats the image as hex text: the bytes of a group (one byte, or a whole instruction without splitInstructions) are separated by nothing,
+// groups by a space, or by a new line once the line has bytesPerLine bytes.
+class HexFormatter {
+public:
+	HexFormatter(const CodeImage &code_, const vector<Marker> &markers_, size_t bytesPerLine_, bool splitInstructions_)
+		: code(code_), markers(markers_), bytesPerLine(bytesPerLine_), splitInstructions(splitInstructions_) {
+		// Markers are written until two of them share a position, the later ones were never reached by the old writer either
+		while (markerNum < markers.size() && (markerNum == 0 || markers[markerNum].pos > markers[markerNum - 1].pos)) markerNum++;
+	}
+
+	// Size of the text of [begin_, end_) when every byte is a group
+	size_t splitSize(size_t begin_, size_t end_) const {
+		size_t size = (end_ - begin_) * 3;
+		for (size_t m = firstMarker(begin_); m < markerNum && markers[m].pos < end_; m++) size += markers[m].str.size() + 3;
+		return size;
+	}
+
+	// Splits the image into chunks of about chunkBytes_ bytes which start on a new line and finds where each one starts in the output.
+	// Returns the size of the whole output
+	size_t plan(size_t chunkBytes_, vector<HexChunk> &rChunks_) const {
+		size_t size = code.size();
+
+		if (splitInstructions) { // Every line has the same number of bytes
+			size_t lineBytes = std::max<size_t>(bytesPerLine, 1);
+			size_t step = lineBytes >= chunkBytes_ ? lineBytes : (chunkBytes_ + lineBytes - 1) / lineBytes * lineBytes; // A longer line is a chunk of its own, --bytes=-1 makes the whole image one line
+
+			size_t outSize = 0;
+			for (size_t b = 0; b < size; b += step) {
+				size_t e = std::min(b + step, size);
+				rChunks_.push_back({ b, e, outSize });
+				outSize += splitSize(b, e);
+			}
+			return outSize;
+		}
 
-			if (splitInstructions_ || j == code_[i].byteNum - 1) {
-				if (column >= bytesPerLine_) {
-					column = 0;
-					outStr.push_back('\n');
+		size_t outSize = 0, column = 0, spanIdx = 0, markerIdx = 0;
+		HexChunk chunk{ 0, 0, 0 };
+		for (size_t a = 0; a < size;) {
+			size_t end = groupEnd(a, spanIdx);
+			for (; markerIdx < markerNum && markers[markerIdx].pos < end; markerIdx++) outSize += markers[markerIdx].str.size() + 3;
+			outSize += (end - a) * 2 + 1;
+
+			column += end - a;
+			a = end;
+			if (column >= bytesPerLine) {
+				column = 0;
+				if (a - chunk.begin >= chunkBytes_ && a < size) {
+					chunk.end = a;
+					rChunks_.push_back(chunk);
+					chunk = { a, 0, outSize };
 				}
-				else {
-					outStr.push_back(' ');
+			}
+		}
+		chunk.end = size;
+		if (chunk.end > chunk.begin) rChunks_.push_back(chunk);
+		return outSize;
+	}
+
+	// First address at or after address_ where a group starts
+	size_t nextGroup(size_t address_) const {
+		if (splitInstructions) return address_;
+
+		auto span = std::partition_point(code.instructions.begin(), code.instructions.end(), [&](const InstructionSpan &s_) { return s_.begin + s_.byteNum <= address_; });
+		return span != code.instructions.end() && span->begin < address_ ? span->begin + span->byteNum : address_;
+	}
+
+	// Formats [begin_, end_), rColumn_ bytes into a line. Returns the end of the written text
+	char *format(size_t begin_, size_t end_, char *pOut_, size_t &rColumn_) const {
+		ImageReader image(code, begin_);
+		size_t markerIdx = firstMarker(begin_);
+		size_t spanIdx = std::partition_point(code.instructions.begin(), code.instructions.end(), [&](const InstructionSpan &s_) { return s_.begin + s_.byteNum <= begin_; }) - code.instructions.begin();
+
+		size_t column = rColumn_;
+		for (size_t a = begin_; a < end_;) {
+			size_t end = groupEnd(a, spanIdx);
+			for (; a < end; a++) {
+				if (markerIdx < markerNum && markers[markerIdx].pos == a) {
+					const string &str = markers[markerIdx++].str;
+					*pOut_++ = '<';
+					pOut_ = std::copy(str.begin(), str.end(), pOut_);
+					*pOut_++ = '>';
+					*pOut_++ = ' ';
 				}
+
+				const char *pair = &hexPairs[image[a] * 2];
+				pOut_[0] = pair[0];
+				pOut_[1] = pair[1];
+				pOut_ += 2;
+
+				column++;
+			}
+
+			if (column >= bytesPerLine) {
+				column = 0;
+				*pOut_++ = '\n';
+			}
+			else *pOut_++ = ' ';
+		}
+
+		rColumn_ = column;
+		return pOut_;
+	}
+
+private:
+	const CodeImage &code;
+	const vector<Marker> &markers;
+	size_t markerNum = 0;
+	size_t bytesPerLine;
+	bool splitInstructions;
+
+	size_t firstMarker(size_t address_) const {
+		return std::partition_point(markers.begin(), markers.begin() + markerNum, [&](const Marker &m_) { return m_.pos < address_; }) - markers.begin();
+	}
+
+	// End of the group starting at address_. rSpanIdx_ is the first instruction which doesn't end before address_
+	size_t groupEnd(size_t address_, size_t &rSpanIdx_) const {
+		if (splitInstructions) return address_ + 1;
+
+		const auto &spans = code.instructions;
+		while (rSpanIdx_ != spans.size() && spans[rSpanIdx_].begin + spans[rSpanIdx_].byteNum <= address_) rSpanIdx_++;
+		if (rSpanIdx_ != spans.size() && spans[rSpanIdx_].begin <= address_) return spans[rSpanIdx_].begin + spans[rSpanIdx_].byteNum;
+		return address_ + 1; // Strings and padding
+	}
+};
+
+// The text is formatted and written in chunks, so only a few of them are in memory at once.
+// With threads_ > 1, threads_ - 1 workers format the chunks into a ring of buffers while this thread writes them in order
+bool saveCode(const CodeImage &code_, const string &fileName_, size_t bytesPerLine_, bool splitInstructions_, const vector<Marker> &markers_, size_t *pByteNum_, unsigned int threads_) {
+
+	std::ofstream ofs(fileName_, std::ios::trunc | std::ios::binary);
+	if (!ofs.is_open()) return 0;
+
+	constexpr size_t chunkBytes = 1 << 16;
+
+	HexFormatter formatter(code_, markers_, bytesPerLine_, splitInstructions_);
+	size_t size = code_.size();
+
+	vector<HexChunk> chunks;
+	size_t outSize = formatter.plan(chunkBytes, chunks);
+	auto formatChunk = [&](size_t c_, vector<char> &rOut_) {
+		rOut_.resize((c_ + 1 < chunks.size() ? chunks[c_ + 1].outOffset : outSize) - chunks[c_].outOffset);
+		size_t column = 0;
+		formatter.format(chunks[c_].begin, chunks[c_].end, rOut_.data(), column);
+	};
+
+	if (threads_ <= 1 || chunks.size() <= 1) {
+		vector<char> outStr;
+		for (size_t c = 0; c < chunks.size(); c++) {
+			formatChunk(c, outStr);
+			ofs.write(outStr.data(), outStr.size());
+		}
+	}
+	else {
+		size_t slotNum = (size_t)threads_ * 2; // Chunk c goes to slot c % slotNum, once chunk c - slotNum was written
+		vector<vector<char>> slots(slotNum);
+		vector<uint8_t> formatted(chunks.size(), 0);
+		size_t nextChunk = 0, writtenNum = 0;
+
+		std::mutex mutex;
+		std::condition_variable changed;
+
+		auto work = [&]() {
+			std::unique_lock lock(mutex);
+			while (nextChunk < chunks.size()) {
+				size_t c = nextChunk++;
+				changed.wait(lock, [&]() { return c < writtenNum + slotNum; });
+
+				lock.unlock();
+				formatChunk(c, slots[c % slotNum]);
+				lock.lock();
+
+				formatted[c] = 1;
+				changed.notify_all();
+			}
+		};
+
+		vector<std::thread> workers;
+		for (unsigned int t = 1; t < std::min<size_t>(threads_, chunks.size() + 1); t++) workers.emplace_back(work);
+
+		for (size_t c = 0; c < chunks.size(); c++) {
+			{
+				std::unique_lock lock(mutex);
+				changed.wait(lock, [&]() { return formatted[c] != 0; });
+			}
+
+			const vector<char> &outStr = slots[c % slotNum];
+			ofs.write(outStr.data(), outStr.size());
+
+			std::lock_guard lock(mutex);
+			writtenNum = c + 1;
+			changed.notify_all();
+		}
+		for (auto &w : workers) w.join();
+	}
+
+	if (pByteNum_ != nullptr) *pByteNum_ = size;
+
+	return ofs.good();
+}
+
+// The gaps between segments are never written: the file is sized first, so they're already zeros
+bool saveBinary(const CodeImage &code_, const string &fileName_, size_t *pByteNum_) {
+
+	size_t size = code_.size();
+	if (pByteNum_ != nullptr) *pByteNum_ = size;
+
+#ifdef SB_UASM_MMAP
+	int fd = open(fileName_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return 0;
+
+	bool ok = ftruncate(fd, (off_t)size) == 0;
+	if (ok && size != 0) {
+		void *pMapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		ok = pMapped != MAP_FAILED;
+		if (ok) {
+			uint8_t *pOut = (uint8_t *)pMapped;
+			for (size_t s = 0; s < code_.segments.size(); s++) {
+				size_t end = s + 1 < code_.segments.size() ? code_.segments[s + 1].offset : code_.bytes.size();
+				std::copy(code_.bytes.begin() + code_.segments[s].offset, code_.bytes.begin() + end, pOut + code_.segments[s].address);
 			}
+			munmap(pMapped, size);
 		}
 	}
 
+	return close(fd) == 0 && ok;
+#else
+	std::ofstream ofs(fileName_, std::ios::trunc | std::ios::binary);
+	if (!ofs.is_open()) return 0;
+
+	for (size_t s = 0; s < code_.segments.size(); s++) {
+		size_t end = s + 1 < code_.segments.size() ? code_.segments[s + 1].offset : code_.bytes.size();
+		ofs.seekp(code_.segments[s].address);
+		ofs.write((const char *)code_.bytes.data() + code_.segments[s].offset, end - code_.segments[s].offset);
+	}
+	if (size != 0 && code_.segments.back().offset == code_.bytes.size()) { // The image ends with a gap
+		ofs.seekp(size - 1);
+		ofs.put(0);
+	}
+
+	return ofs.good();
+#endif
+}
+
+static void appendMarkerLine(string &rOut_, const Marker &marker_) {
+	char address[24];
+	snprintf(address, sizeof(address), "%08zX", marker_.pos);
+
+	rOut_ += address;
+	rOut_ += ' ' + marker_.str;
+	for (size_t f = 0; f < marker_.includeStack.size(); f++)
+		rOut_ += (f ? " > " : "  ") + marker_.includeStack[f].location.name + ':' + numToStr(marker_.includeStack[f].line + 1);
+	rOut_ += '\n';
+}
+
+bool saveMarkerMap(const vector<Marker> &markers_, const string &fileName_) {
+
+	std::ofstream ofs(fileName_, std::ios::trunc | std::ios::binary);
+	if (!ofs.is_open()) return 0;
+
+	string outStr;
+	for (const Marker &m : markers_) appendMarkerLine(outStr, m);
+
 	ofs.write(outStr.data(), outStr.size());
+	return ofs.good();
+}
 
-	if (pByteNum_ != nullptr) *pByteNum_ = byteNum;
+CodeStream::CodeStream(const string &fileName_, bool binary_, size_t bytesPerLine_, bool splitInstructions_, bool markerMap_)
+	: fileName(fileName_), binary(binary_), bytesPerLine(bytesPerLine_), splitInstructions(splitInstructions_), markerMap(markerMap_) {
 
-	return 1;
+	ofs.open(fileName + ".part", std::ios::trunc | std::ios::binary);
+	if (markerMap) mapOfs.open(fileName + ".map.part", std::ios::trunc | std::ios::binary);
+
+	writer = std::thread([this]() { run(); });
+}
+
+CodeStream::~CodeStream() {
+	if (finished) return;
+
+	{
+		std::lock_guard lock(mutex);
+		queue.clear();
+	}
+	close();
+
+	ofs.close();
+	mapOfs.close();
+
+	std::error_code ec;
+	std::filesystem::remove(fileName + ".part", ec);
+	if (markerMap) std::filesystem::remove(fileName + ".map.part", ec);
+}
+
+void CodeStream::push(CodeImage piece_, vector<Marker> markers_) {
+	std::unique_lock lock(mutex);
+	changed.wait(lock, [&]() { return queue.size() < maxQueued; });
+
+	queue.push_back({ std::move(piece_), std::move(markers_) });
+	changed.notify_all();
+}
+
+bool CodeStream::finish(size_t *pByteNum_) {
+	close();
+	finished = true;
+
+	if (pByteNum_ != nullptr) *pByteNum_ = written;
+
+	bool ok = ofs.is_open() && (!markerMap || mapOfs.is_open());
+	if (ok && binary && written > fileEnd) { // The image ends with a gap
+		ofs.seekp(written - 1);
+		ofs.put(0);
+	}
+
+	ofs.close();
+	mapOfs.close();
+	ok = ok && !ofs.fail() && (!markerMap || !mapOfs.fail()); // close() fails on a stream that was never opened
+
+	std::error_code ec;
+	if (ok) std::filesystem::rename(fileName + ".part", fileName, ec);
+	if (ok && !ec && markerMap) std::filesystem::rename(fileName + ".map.part", fileName + ".map", ec);
+	if (ok && !ec) return 1;
+
+	std::filesystem::remove(fileName + ".part", ec);
+	if (markerMap) std::filesystem::remove(fileName + ".map.part", ec);
+	return 0;
+}
+
+void CodeStream::run() {
+	while (true) {
+		Piece piece;
+		{
+			std::unique_lock lock(mutex);
+			changed.wait(lock, [&]() { return !queue.empty() || closing; });
+			if (queue.empty()) return;
+
+			piece = std::move(queue.front());
+			queue.pop_front();
+		}
+		changed.notify_all();
+
+		if (!ofs.is_open()) continue;
+
+		if (binary) writeBinary(piece);
+		else writeText(piece);
+	}
+}
+
+// Formatted chunkBytes of the image at a time, each one ending where a group does
+void CodeStream::writeText(Piece &rPiece_) {
+	size_t shownNum = 0;
+	while (!markersEnded && shownNum < rPiece_.markers.size()) {
+		size_t pos = rPiece_.markers[shownNum].pos;
+		if (lastMarkerPos != SIZE_MAX && pos <= lastMarkerPos) markersEnded = true;
+		else {
+			lastMarkerPos = pos;
+			shownNum++;
+		}
+	}
+	rPiece_.markers.resize(shownNum);
+
+	HexFormatter formatter(rPiece_.code, rPiece_.markers, bytesPerLine, splitInstructions);
+	size_t end = rPiece_.code.size();
+
+	for (size_t a = written; a < end;) {
+		size_t chunkEnd = formatter.nextGroup(std::min(end, a + chunkBytes));
+		outStr.resize(formatter.splitSize(a, chunkEnd));
+
+		char *pEnd = formatter.format(a, chunkEnd, outStr.data(), column);
+		ofs.write(outStr.data(), pEnd - outStr.data());
+		a = chunkEnd;
+	}
+	written = end;
+}
+
+void CodeStream::writeBinary(Piece &rPiece_) {
+	const CodeImage &code = rPiece_.code;
+	for (size_t s = 0; s < code.segments.size(); s++) {
+		size_t begin = code.segments[s].offset;
+		size_t end = s + 1 < code.segments.size() ? code.segments[s + 1].offset : code.bytes.size();
+		if (end == begin) continue;
+
+		ofs.seekp(code.segments[s].address);
+		ofs.write((const char *)code.bytes.data() + begin, end - begin);
+		fileEnd = code.segments[s].address + end - begin;
+	}
+	written = code.size();
+
+	if (!markerMap) return;
+
+	mapStr.clear();
+	for (const Marker &m : rPiece_.markers) appendMarkerLine(mapStr, m);
+	mapOfs.write(mapStr.data(), mapStr.size());
+}
+
+void CodeStream::close() {
+	{
+		std::lock_guard lock(mutex);
+		closing = true;
+	}
+	changed.notify_all();
+
+	if (writer.joinable()) writer.join();
 }
\ No newline at end of file
@@ -28,15 +28,181 @@ struct FilePathAndName {
 struct ProcessedFile {
 	FilePathAndName location;
 	int line = 0;
-	MacroMap macros;
+};
+
+// Tokenized file contents. Every %include of a file shares the same body, and it's never modified.
+struct ScriptBody {
+	static constexpr uint32_t NoBranch = UINT32_MAX;
+
+	vector<Expression> lines;
+	vector<uint32_t> nextBranch; // For %if, %elif and %else lines: the next %elif, %else or %endif of the same block. NoBranch for other lines and unclosed blocks
+
+	struct BlockError {
+		uint32_t line; // Where it's reported
+		Result result;
+	};
+	unordered_map<uint32_t, BlockError> blockErrors; // %if line -> first error of its block: %elif or %else after %else, or a missing %endif
+
+	ScriptBody(vector<Expression> lines_);
+};
+
+using SharedBody = std::shared_ptr<const ScriptBody>;
+
+// Set when the whole file is wrapped in  %if <cond> ... %endif  and nothing outside of it would reach the assembler.
+// Once <cond> becomes false, including the file again has no effect.
+struct IncludeGuard {
+	size_t ifLine = SIZE_MAX;
+	vector<Symbol> identifiers; // Used in the %if line, so they can be looked up without the whole macro map
+
+	bool found() const { return ifLine != SIZE_MAX; }
+};
+
+struct SourceFile {
+	SharedBody body;
+	IncludeGuard guard;
+};
+
+// Tokenizes a file a chunk of lines at a time, instead of all at once like readFile().
+// A chunk only ends outside of %if blocks, so its branch table is the same as the one of the whole file.
+class ScriptReader {
+public:
+	bool open(const string &fileName_);
+
+	bool atEnd() const { return nextLine == script.lines.size(); }
+	SharedBody next();
+
+private:
+	static constexpr size_t chunkLines = 4096;
+
+	ScriptBuffer script;
+	size_t nextLine = 0;
+};
+
+struct IncludeFrame {
+	SharedBody body;
+	size_t cursor = 0;
+};
+
+// Reads the script line by line through a stack of include frames, instead of pasting included files into the script.
+// Every line that is read is appended to output, where it's processed in place.
+class ScriptCursor {
+public:
+	vector<Expression> output;
+
+	ScriptCursor(SharedBody main_) { frames.push_back({ std::move(main_) }); }
+	ScriptCursor(ScriptReader &rMain_) : pMainReader(&rMain_) { frames.push_back({ rMain_.next() }); } // The main file is read as the cursor reaches it
+
+	bool next(); // Reads the next line into current(). Returns false at the end of the main file
+	Expression &current() { return output.back(); }
+	void unread(); // The current line will be read again by next()
+
+	// Replaces the current line with pushLine_, which is read next, followed by the body and a %file_pop line
+	void include(SharedBody body_, Expression pushLine_);
+
+	// Body and index of the current line, or nullptr if it was generated (%file_push, %file_pop)
+	const ScriptBody *currentBody() const { return fromFrame ? frames.back().body.get() : nullptr; }
+	size_t currentIndex() const { return frames.back().cursor - 1; }
+
+	// Moves to the line before target_ in the current body. Skipped lines are output the same way ifCondition() leaves them
+	void skipTo(size_t target_);
+
+private:
+	vector<IncludeFrame> frames;
+	ScriptReader *pMainReader = nullptr;
+	Expression pendingLine;
+	bool hasPendingLine = false;
+	bool fromFrame = false;
 };
 
 struct Marker {
 	string str;
 	size_t pos;
+	vector<ProcessedFile> includeStack; // Where the marker was defined, the main file first
+};
+
+// Header of a cache entry: everything the source file is checked against. Built once per read file
+struct TokenCacheKey {
+	string path; // Absolute
+	uint64_t size;
+	int64_t mtime;
+	uint64_t hash;
+
+	TokenCacheKey(const string &fileName_, std::string_view source_);
+};
+
+// Tokenized files stored in a directory, so later compilations don't lex the same libraries again.
+// An entry is used only if the size, modification time and contents of the source still match, and its own contents match the hash stored with them.
+// Entries are written to a temporary file and renamed, so concurrent compilations never read a partial one.
+class TokenCache {
+public:
+	size_t hits = 0, misses = 0;
+
+	TokenCache(string dir_) : dir(std::move(dir_)) {}
+
+	bool load(const TokenCacheKey &key_, vector<Expression> &rTokScript_);
+	void store(const TokenCacheKey &key_, const vector<Expression> &tokScript_);
+
+private:
+	string dir;
+
+	string entryPath(const TokenCacheKey &key_) const;
 };
 
-bool readFile(vector<Expression> &rTokScript_, const string &fileName_);
-bool saveCode(const vector<Instruction> &code_, const string &fileName_, size_t bytesPerLine_ = 16, bool splitInstructions_ = true, const vector<Marker> &markers_ = {}, size_t *pByteNum_ = nullptr);
+// Used for included files. main() points it at a cache when --cache-dir is given
+inline TokenCache *tokenCache = nullptr;
+
+bool readFile(vector<Expression> &rTokScript_, const string &fileName_, TokenCache *pCache_ = nullptr);
+bool saveCode(const CodeImage &code_, const string &fileName_, size_t bytesPerLine_ = 16, bool splitInstructions_ = true, const vector<Marker> &markers_ = {}, size_t *pByteNum_ = nullptr, unsigned int threads_ = 1);
+bool saveBinary(const CodeImage &code_, const string &fileName_, size_t *pByteNum_ = nullptr);
+bool saveMarkerMap(const vector<Marker> &markers_, const string &fileName_); // One line per marker: address, name and include stack
+
+// Writes the output while the program is still being assembled. Pieces of the image are formatted and written on a separate thread,
+// and push() waits while maxQueued of them are in memory. The files are written as <name>.part and renamed by finish(),
+// so a failed compilation leaves the previous output as it was.
+class CodeStream {
+public:
+	CodeStream(const string &fileName_, bool binary_, size_t bytesPerLine_ = 16, bool splitInstructions_ = true, bool markerMap_ = false);
+	~CodeStream();
+
+	// Every piece starts where the previous one ended: at the address of its first segment. Its markers are in order
+	void push(CodeImage piece_, vector<Marker> markers_);
+	bool finish(size_t *pByteNum_ = nullptr); // False if a file couldn't be written
+
+private:
+	struct Piece {
+		CodeImage code;
+		vector<Marker> markers;
+	};
+
+	static constexpr size_t maxQueued = 4;
+	static constexpr size_t chunkBytes = 1 << 16; // Of the image formatted at once
+
+	string fileName;
+	bool binary;
+	size_t bytesPerLine;
+	bool splitInstructions;
+	bool markerMap;
+
+	std::ofstream ofs, mapOfs;
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable changed;
+	deque<Piece> queue;
+	bool closing = false, finished = false;
+
+	// Used by the writer thread only
+	size_t written = 0; // Address after the last written piece
+	size_t column = 0;
+	size_t fileEnd = 0; // Binary: end of the written bytes
+	bool markersEnded = false; // Text: two markers shared a position, the old writer never wrote any after them
+	size_t lastMarkerPos = SIZE_MAX;
+	vector<char> outStr;
+	string mapStr;
+
+	void run();
+	void writeText(Piece &rPiece_);
+	void writeBinary(Piece &rPiece_);
+	void close();
+};
 
 #endif
\ No newline at end of file
@@ -4,48 +4,33 @@
 #include "files.hpp"
 #include "compiler_commands.hpp"
 #include "preprocessor.hpp"
+#include "pipeline.hpp"
+#include "arguments.hpp"
 
-struct CommandArguments {
-	vector<string> args;
-	unordered_map<string, string> longFlags;
-	bool shortFlags[256]{};
-
-	void parse(int argc, char* argv[]) {
-		for (int i = 0; i < argc; i++) {
-			if (argv[i][0] == '-') {
-				if (argv[i][1] == '-') {
-					char *valBegin = argv[i] + 4; // --x=v
-					while (*valBegin != '\0' && *(valBegin - 1) != '=') valBegin++;
-					longFlags[string(argv[i] + 2, valBegin - 1)] = string(valBegin);
-				}
-				else for (int c = 1; argv[i][c] != '\0'; c++) {
-					if ((argv[i][c] >= 'a' && argv[i][c] <= 'z') || (argv[i][c] >= 'A' && argv[i][c] <= 'Z'))
-						shortFlags[argv[i][c]] = true;
-				}
-			}
-			else {
-				args.push_back(argv[i]);
-			}
-		}
-	}
-};
+#include <filesystem>
+#include <optional>
 
 int main(int argc, char* argv[]) {
 	
 	if (argc < 3) {
 		fputs(
 			"Usage:\n"
-			"  .exe <src> <out> [--bytes=16] [-w] [-m] [-s]\n"
+			"  .exe <src> <out> [--format=hex] [--bytes=16] [--threads=1] [--cache-dir=<dir>] [--stream] [-w] [-m] [-s] [--stats]\n"
 			"\n"
 			"Arguments:\n"
-			"  src      - Source file\n"
-			"  out      - Output file\n"
+			"  src         - Source file\n"
+			"  out         - Output file\n"
 			"\n"
 			"Options:\n"
-			"  --bytes  - Number of bytes per line (default: 16)\n"
-			"  -w       - Do not split instructions into separate bytes\n"
-			"  -m       - Add markers to the output code\n"
-			"  -s       - Show include stack in error messages\n",
+			"  --format    - hex: text with the bytes in hex, bin: raw memory image, markers go to <out>.map (default: hex)\n"
+			"  --bytes     - Number of bytes per line (default: 16)\n"
+			"  --threads   - Threads encoding the instructions and writing the output, 0 uses all cores (default: 1)\n"
+			"  --cache-dir - Directory for tokenized included files, shared by compilations\n"
+			"  --stream    - Assemble and write the output while the source is read, so memory doesn't grow with the program\n"
+			"  -w          - Do not split instructions into separate bytes\n"
+			"  -m          - Add markers to the output code\n"
+			"  -s          - Show include stack in error messages\n"
+			"  --stats     - Show compiler statistics\n",
 			stdout
 		);
 		return -1;
@@ -57,6 +42,8 @@ int main(int argc, char* argv[]) {
 	bool splitInstructions = !args.shortFlags['w'];
 	bool addMarkers = args.shortFlags['m'];
 	bool showIncludeStack = args.shortFlags['s'];
+	bool showStats = args.longFlags.find("stats") != args.longFlags.end();
+	bool streamOutput = args.longFlags.find("stream") != args.longFlags.end();
 	int bytesPerLine = 16;
 	{
 		auto it = args.longFlags.find("bytes");
@@ -65,24 +52,76 @@ int main(int argc, char* argv[]) {
 			if (strToNum(it->second, val)) bytesPerLine = val;
 		}
 	}
+	bool binaryOutput = false;
+	{
+		auto it = args.longFlags.find("format");
+		if (it != args.longFlags.end()) {
+			if (it->second == "bin") binaryOutput = true;
+			else if (it->second != "hex") {
+				fputs("Error: Unknown output format.\n", stdout);
+				return -1;
+			}
+		}
+	}
+	unsigned int threads = 1;
+	{
+		auto it = args.longFlags.find("threads");
+		if (it != args.longFlags.end()) {
+			int val;
+			if (strToNum(it->second, val) && val >= 0) threads = val ? val : std::max(std::thread::hardware_concurrency(), 1u);
+		}
+	}
+
+	std::optional<TokenCache> libraryCache;
+	if (auto it = args.longFlags.find("cache-dir"); it != args.longFlags.end()) {
+		std::error_code ec;
+		std::filesystem::create_directories(it->second, ec);
+		if (ec) {
+			fputs("Error: Unable to create the cache directory.\n", stdout);
+			return -2;
+		}
+		tokenCache = &libraryCache.emplace(it->second);
+	}
+
+	// Declared before anything that holds expressions, so it's destroyed last and all nodes go away with it
+	std::pmr::monotonic_buffer_resource exprMemory;
+	std::pmr::unsynchronized_pool_resource exprPool(&exprMemory);
+	exprArena = &exprPool;
+
+	FoldCache constants;
+	foldCache = &constants;
 
 	vector<ProcessedFile> fileStack;
 	vector<Expression> tokScript;
-	vector<Instruction> code;
+	ScriptReader mainReader;
+	CodeImage code;
 	vector<Marker> markers;
 	
-	if (!readFile(tokScript, args.args[1])) {
+	if (streamOutput ? !mainReader.open(args.args[1]) : !readFile(tokScript, args.args[1])) {
 		fputs("Error: Unable to open file.\n", stdout);
 		return -2;
 	}
 
 	Result result = {};
+	int instructionCount;
+	size_t byteNum;
 
 	ProcessedFile mainFile;
 	mainFile.location = args.args[1];
 	mainFile.line = 0;
 
 	fileStack.push_back(mainFile);
+
+	if (streamOutput) {
+		CodeStream out(args.args[2], binaryOutput, bytesPerLine, splitInstructions, binaryOutput && addMarkers);
+		result = assembleStream(mainReader, fileStack, out, addMarkers, instructionCount);
+		if (result.code == NoError && !out.finish(&byteNum)) {
+			fputs("Error: Unable to open file.\n", stdout);
+			return -2;
+		}
+		goto end;
+	}
+
 	result = preprocessor(tokScript, fileStack);
 	if (result.code != NoError) goto end;
 
@@ -93,14 +132,17 @@ int main(int argc, char* argv[]) {
 			%marker, %file_push & %file_pop directives (for debugging), and %define, and other things that we don't care about
 	*/
 
-	int instructionCount;
 	fileStack[0] = mainFile;
-	result = assembleCode(tokScript, code, markers, addMarkers, fileStack, instructionCount);
+	result = assembleCode(tokScript, code, markers, addMarkers, fileStack, instructionCount, threads);
 	if (result.code != NoError) goto end;
 	
-	size_t byteNum;
-	
-	if (!saveCode(code, args.args[2], bytesPerLine, splitInstructions, markers, &byteNum)) {
+	if (binaryOutput) {
+		if (!saveBinary(code, args.args[2], &byteNum) || (addMarkers && !saveMarkerMap(markers, args.args[2] + ".map"))) {
+			fputs("Error: Unable to open file.\n", stdout);
+			return -2;
+		}
+	}
+	else if (!saveCode(code, args.args[2], bytesPerLine, splitInstructions, markers, &byteNum, threads)) {
 		fputs("Error: Unable to open file.\n", stdout);
 		return -2;
 	}
@@ -127,5 +169,16 @@ end:
 		fputs(errStr.c_str(), stdout);
 	}
 
+	if (showStats) {
+		size_t folds = constants.hits + constants.misses;
+		string statStr =
+			"Statistics:\n"
+			"  constant folding: " + numToStr(constants.hits) + " of " + numToStr(folds) + " expressions reused (" + numToStr(folds ? 100.f * constants.hits / folds : 0.f, std::chars_format::fixed, 1) + "%)\n";
+
+		if (libraryCache) statStr += "  token cache: " + numToStr(libraryCache->hits) + " of " + numToStr(libraryCache->hits + libraryCache->misses) + " included files loaded\n";
+
+		fputs(statStr.c_str(), stdout);
+	}
+
 	return result.code;
 }
\ No newline at end of file
@@ -1,133 +1,279 @@
 #include "parser.hpp"
 
-static bool removeCommentsInLine(string &rStr_, const string &multilineCommentBegin_, const string &multilineCommentEnd_) {
-	size_t multilineCommBeg = 0, multilineCommEnd = 0;
+// Comments are removed and continued lines are joined in a single pass over the buffer.
+// Text is only ever moved towards the beginning of the buffer, so everything is done in place.
+void prepareScript(ScriptBuffer &rScript_, std::string_view singleLineCommentBegin_, std::string_view multilineCommentBegin_, std::string_view multilineCommentEnd_) {
 
-	while (true) {
-		multilineCommBeg = rStr_.find(multilineCommentBegin_, multilineCommBeg);
-		multilineCommEnd = rStr_.find(multilineCommentEnd_, multilineCommBeg);
+	char *text = rScript_.text.data();
+
+	size_t write = 0;
+	bool inMultilineComment = false;
+	ScriptLine *pJoinedLine = nullptr; // The line that the following lines are appended to, if the previous one ended with '\'
+
+	auto copy = [&](std::string_view str_) {
+		memmove(text + write, str_.data(), str_.size());
+		write += str_.size();
+	};
+
+	for (auto &line : rScript_.lines) {
+		std::string_view str(text + line.begin, line.end - line.begin);
+		size_t lineBegin = write;
 
-		if (multilineCommBeg != string::npos) {
+		if (inMultilineComment) {
+			size_t multilineCommEnd = str.find(multilineCommentEnd_);
 			if (multilineCommEnd != string::npos) {
-				rStr_.erase(rStr_.begin() + multilineCommBeg, rStr_.begin() + multilineCommEnd + multilineCommentBegin_.size());
-			}
-			else {
-				rStr_.erase(rStr_.begin() + multilineCommBeg, rStr_.end());
-				return 1;
+				str.remove_prefix(multilineCommEnd + multilineCommentEnd_.size());
+				inMultilineComment = false;
 			}
 		}
-		else return 0;
-	}
-}
-
-void removeComments(vector<string> &rScript_, const string &singleLineCommentBegin_, const string &multilineCommentBegin_, const string &multilineCommentEnd_) {
 
-	for (int l = 0; l < rScript_.size(); l++) {
-		size_t singleLineCommBeg = rScript_[l].find(singleLineCommentBegin_);
-		if (singleLineCommBeg != string::npos) rScript_[l].erase(singleLineCommBeg);
+		if (!inMultilineComment) {
+			str = str.substr(0, str.find(singleLineCommentBegin_));
 
-		bool inMultilineComment = removeCommentsInLine(rScript_[l], multilineCommentBegin_, multilineCommentEnd_);
-
-		if (inMultilineComment) {
+			size_t pos = 0;
 			while (true) {
-				if (++l >= rScript_.size()) return;
+				size_t multilineCommBeg = str.find(multilineCommentBegin_, pos);
+				if (multilineCommBeg == string::npos) {
+					copy(str.substr(pos));
+					break;
+				}
+
+				copy(str.substr(pos, multilineCommBeg - pos));
 
-				size_t multilineCommEnd = rScript_[l].find(multilineCommentEnd_);
-				if (multilineCommEnd != string::npos) {
-					rScript_[l--].erase(0, multilineCommEnd + multilineCommentEnd_.size());
+				size_t multilineCommEnd = str.find(multilineCommentEnd_, multilineCommBeg); // "/*/" is a whole comment
+				if (multilineCommEnd == string::npos) {
+					inMultilineComment = true;
 					break;
 				}
 
-				rScript_[l].clear();
+				pos = multilineCommEnd + multilineCommentEnd_.size();
 			}
 		}
+
+		bool continued = write != lineBegin && text[write - 1] == '\\';
+		if (continued) write--;
+
+		if (pJoinedLine != nullptr) {
+			pJoinedLine->end = write;
+			line = { write, write };
+		}
+		else {
+			line = { lineBegin, write };
+		}
+
+		if (!continued) pJoinedLine = nullptr;
+		else if (pJoinedLine == nullptr) pJoinedLine = &line;
 	}
 }
 
-void getNextToken(const char *&rTokBeg_, const char *&rTokEnd_, const char *end_, const char *delim_, const char *range_, const char *string_) {
+bool Lexer::next(std::string_view &rTok_, TokenType &rType_) {
 
 	// [ ] token
 	while (true) {
-		if (rTokBeg_ == end_) {
-			rTokEnd_ = rTokBeg_;
-			return;
-		}
-
-		if (!isOneOf(*rTokBeg_, delim_)) break;
-		rTokBeg_++;
+		if (pos == end) return false;
+		if (!charClasses.is(*pos, CharDelimiter)) break;
+		pos++;
 	}
 	// [t]oken
 
-	rTokEnd_ = rTokBeg_;
+	const bool rangesAllowed = splitRanges && depth == 0;
 
-	for (const char *strInd = string_; *strInd != '\0'; strInd++)
-	if (*rTokBeg_ == *strInd) { // ["]some(string)"
-		rTokEnd_ = rTokBeg_ + 2; // "s[o]me(string)"  // ""[ ]
+	const char *tokBeg = pos;
+	const char *tokEnd = pos + 1;
+	rType_ = TokenAtom;
+
+	if (*tokBeg == '(') {
+		rType_ = TokenGroupBegin;
+		depth++;
+	}
+	else if (*tokBeg == ')' && depth > 0) { // Outside of parentheses ')' is just an invalid character
+		rType_ = TokenGroupEnd;
+		depth--;
+	}
+	else if (charClasses.is(*tokBeg, CharQuote)) { // ["]some(string)"
+		tokEnd = tokBeg + 2; // "s[o]me(string)"  // ""[ ]
 		while (true) {
-			if (rTokEnd_ >= end_) {
-				rTokEnd_ = end_;  // aaa" [ ]  ->  aaa"[ ]
-				return;
+			if (tokEnd >= end) {
+				tokEnd = end; // aaa" [ ]  ->  aaa"[ ]
+				break;
 			}
-			if (*(rTokEnd_ - 1) == *strInd) return;
-			rTokEnd_++;
+			if (*(tokEnd - 1) == *tokBeg) break;
+			tokEnd++;
 		}
 	} // "some(string)"[ ]
+	else if (rangesAllowed && charClasses.is(*tokBeg, CharBracket)) { // [<]Ala ma <kota >>
+		const char open = *tokBeg, close = charClasses.closing[(uint8_t)open];
+		int nestNum = 1;
 
-	for (const char *rangeInd = range_; *rangeInd != '\0'; rangeInd += 2)
-		if (*rTokBeg_ == rangeInd[0]) { // [(]Ala ma (kota ))
-			int nestNum = 1;
+		rType_ = TokenRange;
+		tokEnd = tokBeg + 2; // <A[l]a ma <kota >>
+		while (true) {
+			if (tokEnd >= end) {
+				tokEnd = end;
+				break;
+			}
+			if (*(tokEnd - 1) == open) nestNum++;
+			else if (*(tokEnd - 1) == close) nestNum--;
+			if (nestNum <= 0) break;
 
-			rTokEnd_ = rTokBeg_ + 2; // (A[l]a ma (kota ))
-			while (true) {
-				if (rTokEnd_ >= end_) {
-					rTokEnd_ = end_;
-					return;
-				}
-				if (*(rTokEnd_ - 1) == rangeInd[0]) nestNum++;
-				else if (*(rTokEnd_ - 1) == rangeInd[1]) nestNum--;
-				if (nestNum <= 0) return;
+			tokEnd++;
+		}
+	}
+	else {
+		const uint8_t stopMask = CharDelimiter | CharQuote | CharParenthesis | (depth > 0 ? CharClosing : 0) | (rangesAllowed ? CharBracket : 0);
+		const bool isIdentifier = isPartOfName(*tokBeg);
 
-				rTokEnd_++;
-			}
+		while (tokEnd != end) {
+			if (charClasses.is(*tokEnd, stopMask)) break;
+			if (isPartOfName(*tokEnd) != isIdentifier) break; // Something will eventually throw an error later in compilation
+			tokEnd++;
 		}
+	}
 
-	bool isIdentifier = isPartOfName(*rTokBeg_);
+	rTok_ = std::string_view(tokBeg, tokEnd - tokBeg);
+	pos = tokEnd;
+	return true;
+}
 
-	while (true) {
-		if (rTokEnd_ == end_) return;
-		if (isOneOf(*rTokEnd_, delim_) || isOneOf(*rTokEnd_, range_, 2) /* We don't care about closing brackets */ || isOneOf(*rTokEnd_, string_)) return;
-		if (isPartOfName(*rTokEnd_) != isIdentifier) return;            // Something will eventually throw an error later in compilation
-		rTokEnd_++;
+void tokenizeScript(const ScriptBuffer &script_, vector<Expression> &rTokens_) {
+	rTokens_.reserve(rTokens_.size() + script_.lines.size());
+	for (auto &l : script_.lines)
+		rTokens_.push_back(Expression::parseLine(script_.text.data() + l.begin, script_.text.data() + l.end));
+}
+
+MacroTable::Slot &MacroTable::slot(Symbol sym_) {
+	if (sym_ >= slots.size()) slots.resize(sym_ + 1);
+	return slots[sym_];
+}
+
+// Definition from the chain starting at def_ that is visible in scope_, or NoDef
+uint32_t MacroTable::visibleDef(uint32_t def_, uint32_t scope_) const {
+	while (def_ != NoDef && defs[def_].scope > scope_) def_ = defs[def_].prev;
+	if (def_ == NoDef) return NoDef;
+
+	while (defs[def_].scope < scope_ && scopes[scope_].inheritsParent) scope_--;
+	return defs[def_].scope == scope_ ? def_ : NoDef;
+}
+
+const Macro *MacroTable::find(Symbol sym_) const {
+	if (sym_ >= slots.size()) return nullptr;
+
+	uint32_t def = visibleDef(slots[sym_].local, scopes.size() - 1);
+	if (def != NoDef && defs[def].macro) return defs[def].macro.get();
+	return slots[sym_].global.get();
+}
+
+void MacroTable::defineLocal(Symbol sym_, MacroPtr macro_) {
+	Slot &s = slot(sym_);
+	uint32_t scope = scopes.size() - 1;
+
+	if (s.local != NoDef && defs[s.local].scope == scope) {
+		defs[s.local].macro = std::move(macro_);
+		return;
 	}
+
+	defs.push_back({ std::move(macro_), sym_, scope, s.local });
+	s.local = defs.size() - 1;
 }
 
-vector<string> split(const char *begin_, const char *end_, const char *delim_, const char *range_, const char *string_) {
-	const char *begin = begin_, *end;
-	vector<string> result;
-	while (true) {
-		getNextToken(begin, end, end_, delim_, range_, string_);
-		if (begin == end_) return result;
-		result.push_back(string(begin, end));
-		begin = end;
+void MacroTable::define(Symbol sym_, Macro macro_, bool global_) {
+	macro_.id = ++lastMacroId;
+	MacroPtr macro = std::make_shared<const Macro>(std::move(macro_));
+	if (global_) slot(sym_).global = std::move(macro);
+	else defineLocal(sym_, std::move(macro));
+}
+
+void MacroTable::undef(Symbol sym_, bool global_) {
+	if (sym_ >= slots.size()) return;
+	if (global_) {
+		slots[sym_].global.reset();
+		return;
+	}
+
+	uint32_t def = visibleDef(slots[sym_].local, scopes.size() - 1);
+	if (def != NoDef && defs[def].macro) defineLocal(sym_, nullptr); // Inherited definitions are hidden, not removed
+}
+
+void MacroTable::pushScope() {
+	scopes.push_back({ (uint32_t)defs.size(), false });
+}
+
+void MacroTable::popScope() {
+	while (defs.size() > scopes.back().defBegin) {
+		slots[defs.back().sym].local = defs.back().prev;
+		defs.pop_back();
 	}
+	scopes.pop_back();
 }
 
-void tokenizeScript(vector<string> &rScript_, vector<Expression> &rTokens_) {
-	rTokens_.reserve(rScript_.size());
-	for (auto &s : rScript_)
-		rTokens_.push_back(Expression(split(s.data(), s.data() + s.size(), " \t")));
+void MacroTable::inheritAll() {
+	uint32_t scope = scopes.size() - 1;
+	if (scope == 0) return;
+
+	// Macros defined in both files take the parent's value, as if all of them were copied over
+	for (uint32_t d = scopes[scope].defBegin; d < defs.size(); d++) {
+		uint32_t parentDef = visibleDef(defs[d].prev, scope - 1);
+		if (parentDef != NoDef && defs[parentDef].macro) defs[d].macro = defs[parentDef].macro;
+	}
+	scopes[scope].inheritsParent = true;
+}
+
+bool MacroTable::inherit(Symbol sym_) {
+	uint32_t scope = scopes.size() - 1;
+	if (scope == 0 || sym_ >= slots.size()) return false;
+
+	uint32_t parentDef = visibleDef(slots[sym_].local, scope - 1);
+	if (parentDef == NoDef || !defs[parentDef].macro) return false;
+
+	defineLocal(sym_, defs[parentDef].macro);
+	return true;
 }
 
-void genFinalMacroMap(MacroRefMap &rMacroMap_, const MacroMap &local_, const MacroMap &global_) {
+Expression Expression::parseLine(const char *begin_, const char *end_) {
+	Expression line(ExprList{});
+	Lexer lexer(begin_, end_, true);
+	parseList(lexer, line.expressions);
+	return line;
+}
+
+// Parses tokens until the parenthesis that closes the current group. Returns false if the end of the text is reached first.
+bool Expression::parseList(Lexer &rLexer_, ExprList &rExprs_) {
+	std::string_view tok;
+	TokenType type;
+	while (rLexer_.next(tok, type)) {
+		if (type == TokenGroupEnd) return true;
+		rExprs_.push_back(parseElement(rLexer_, tok, type));
+	}
+	return false;
+}
+
+Expression Expression::parseElement(Lexer &rLexer_, std::string_view tok_, TokenType type_) {
+	switch (type_) {
+	case TokenGroupBegin: {
+		Expression group(ExprList{});
+
+		if (!parseList(rLexer_, group.expressions)) { // Not closed: (5 + 3
+			Expression invalid;
+			invalid.symbol = symbols.intern(std::string_view(tok_.data(), rLexer_.end - tok_.data()));
+			return invalid;
+		}
+
+		if (group.expressions.size() == 1 && group.expressions[0].type == NestedExpression) { // (((...(x)...))) will be reduced to (x), but that's fine ig
+			Expression inner = std::move(group.expressions[0]);
+			return inner;
+		}
 
-	rMacroMap_.clear();
-	for (auto &l : local_) {
-		rMacroMap_[l.first] = &l.second;
+		return group; // () and (   ) stay empty
 	}
 
-	for (auto &g : global_) {
-		if (rMacroMap_.find(g.first) == rMacroMap_.end())
-			rMacroMap_.emplace(g.first, &g.second);
+	case TokenRange:
+		return Expression(tok_);
+
+	default: {
+		Expression atom;
+		atom.parseAtom(tok_);
+		return atom;
+	}
 	}
 }
 
@@ -135,35 +281,29 @@ bool Expression::parse(const char *begin_, const char *end_) {
 	
 	type = Expression::Type::Invalid;
 
-	vector<string> vec = split(begin_, end_, " \t", "()");
-	if (vec.empty()) return 0;
+	Lexer lexer(begin_, end_, false);
 
-	if (vec.size() != 1) {
-		type = Expression::Type::NestedExpression;
+	ExprList exprs;
+	parseList(lexer, exprs);
 
-		for (auto &v : vec)
-			expressions.push_back(Expression(v));
-		
+	if (exprs.empty()) return 0;
+
+	if (exprs.size() != 1) {
+		type = Expression::Type::NestedExpression;
+		expressions = std::move(exprs);
 		return 1;
 	}
 
-	string &str = vec[0];
+	Expression expr = std::move(exprs[0]);
+	*this = std::move(expr);
+	return type != Expression::Type::Invalid;
+}
 
-	if (str.front() == '(' && str.back() == ')') { // (((...(x)...))) will be reduced to (x), but that's fine ig
-		type = Expression::Type::NestedExpression;
-		Expression expr = Expression(str.data() + 1, str.data() + str.size() - 1);
-		
-		if (expr.type == Expression::Type::Invalid && expr.stringVal.empty()) return 1; // for cases like () or (   )
-		
-		if (expr.type == NestedExpression) *this = expr;
-		else expressions.push_back(expr);
+bool Expression::parseAtom(std::string_view str) {
 
-		return 1;
-	}
-	
 	if (str.front() == '"' && str.back() == '"') {
 		type = Expression::Type::String;
-		stringVal = str.substr(1, str.size() - 2);
+		symbol = symbols.intern(str.substr(1, str.size() - 2));
 		return 1;
 	}
 
@@ -191,7 +331,7 @@ bool Expression::parse(const char *begin_, const char *end_) {
 		}
 
 		type = Expression::Type::Invalid;
-		stringVal = str;
+		symbol = symbols.intern(str);
 		return 0;
 	}
 
@@ -203,88 +343,137 @@ bool Expression::parse(const char *begin_, const char *end_) {
 	}
 	else if (isNameValid(str)) {
 		type = Expression::Type::Identifier;
-		stringVal = str;
+		symbol = symbols.intern(str);
 		return 1;
 	}
 	else {
 		type = Expression::Type::Invalid;
-		stringVal = str;
+		symbol = symbols.intern(str);
 		return 0;
 	}
 }
 
-void Expression::replaceMacroArguments(const MacroRefMap &argMap_) { // Only the name and value of the parameter are stored, without additional data like in normal macros.
-	// It will not be possible to do things like:
-	//	%define macro(a b) a * b
-	//	macro(x (y + z)) -> x * y + z
-	// but I doubt anyone will notice, let alone use this, so i'll leave it like this
+ExprList MacroExpansion::instantiate(const Expression *args_, bool singleArg_) const {
+	ExprList result = value.expressions;
 
-	if (type == NestedExpression) {
-		for (int e = 0; e < expressions.size(); e++)
-			expressions[e].replaceMacroArguments(argMap_);
+	for (auto &slot : slots) {
+		Expression *node = &result[paths[slot.pathBegin]];
+		for (uint32_t p = slot.pathBegin + 1; p < slot.pathEnd; p++) node = &node->expressions[paths[p]];
+
+		*node = singleArg_ ? *args_ : args_->expressions[slot.param];
+	}
+
+	return result;
+}
+
+bool Macro::isExpansionValid(const MacroTable &macros_) const {
+	for (auto &use : expansion.uses) {
+		const Macro *found = macros_.find(use.sym);
+		if ((found ? found->id : 0) != use.macroId) return false;
 	}
-	else if (type == Identifier) {
-		auto it = argMap_.find(stringVal);
-		if (it != argMap_.end())
-			*this = *(it->second);
+	return true;
+}
+
+void Macro::findSlots(const Expression &expr_, vector<uint32_t> &rPath_) const {
+	for (uint32_t c = 0; c < expr_.expressions.size(); c++) {
+		const Expression &child = expr_.expressions[c];
+		rPath_.push_back(c);
+
+		if (child.type == Expression::NestedExpression) {
+			findSlots(child, rPath_);
+		}
+		else if (child.type == Expression::Identifier) {
+			for (size_t p = params.size(); p-- > 0;) { // With repeated names the last parameter wins
+				if (params[p] != child.symbol) continue;
+
+				expansion.slots.push_back({ (uint32_t)p, (uint32_t)expansion.paths.size(), (uint32_t)(expansion.paths.size() + rPath_.size()) });
+				expansion.paths.insert(expansion.paths.end(), rPath_.begin(), rPath_.end());
+				break;
+			}
+		}
+
+		rPath_.pop_back();
 	}
 }
 
-Result Expression::replaceMacros(const MacroRefMap &macroMap_) {
+Result Macro::expand(const MacroTable &macros_, const MacroExpansion *&rExpansion_) const {
+	rExpansion_ = &expansion;
+	if (expanded && isExpansionValid(macros_)) return {};
+
+	// Nested macros are replaced first, so identifiers they produce can be parameters as well
+	MacroExpansion result;
+	result.value = value;
+	Result err = result.value.replaceMacros(macros_, &result.uses, paramsShadowMacros ? &params : nullptr);
+	if (err.code != NoError) return err;
+
+	std::sort(result.uses.begin(), result.uses.end(), [](const MacroUse &a_, const MacroUse &b_) { return a_.sym < b_.sym; });
+	result.uses.erase(std::unique(result.uses.begin(), result.uses.end(), [](const MacroUse &a_, const MacroUse &b_) { return a_.sym == b_.sym; }), result.uses.end());
+
+	expansion = std::move(result);
+	expanded = true;
+
+	if (!params.empty()) {
+		vector<uint32_t> path;
+		findSlots(expansion.value, path);
+	}
+
+	return {};
+}
+
+Result Expression::replaceMacros(const MacroTable &macros_, vector<MacroUse> *pUses_, const vector<Symbol> *pSkipped_) {
 	
 	if (type == NestedExpression) {
+		canonical = false;
 		for (int e = expressions.size() - 1; e >= 0; e--) {
 			
 			if (expressions[e].type == NestedExpression) {
-				Result err = expressions[e].replaceMacros(macroMap_);
+				Result err = expressions[e].replaceMacros(macros_, pUses_, pSkipped_);
 				if (err.code != NoError) return err;
 			}
 			else if (expressions[e].type == Identifier) {
+				if (pSkipped_ && std::find(pSkipped_->begin(), pSkipped_->end(), expressions[e].symbol) != pSkipped_->end()) continue;
 
-				auto it = macroMap_.find(expressions[e].stringVal);
-				if (it != macroMap_.end()) {
-					const Expression &macro = *(it->second);
-
-					bool hasParams = macro.expressions.size() == 2;
-					int expectedArgNum = hasParams ? macro.expressions[1].expressions.size() : 0;
+				const Macro *macro = macros_.find(expressions[e].symbol);
+				if (pUses_) pUses_->push_back({ expressions[e].symbol, macro ? macro->id : 0 });
+				if (!macro) continue;
 
-					Expression macroValue = macro.expressions[0];
+				const MacroExpansion *expansion;
+				{
+					Result err = macro->expand(macros_, expansion);
+					if (err.code != NoError) return err;
+				}
+				if (pUses_) pUses_->insert(pUses_->end(), expansion->uses.begin(), expansion->uses.end());
 
-					{
-						Result err = macroValue.replaceMacros(macroMap_);
-						if (err.code != NoError) return err;
-					}
+				int expectedArgNum = macro->params.size();
+				ExprList macroValue;
 
-					// Since the tokens are read from the end of the line, the macros in arguments will already be replaced.
+				// Since the tokens are read from the end of the line, the macros in arguments will already be replaced.
 
-					if (expectedArgNum != 0) {
-						expressions[e + 1].simplify();
+				if (expectedArgNum != 0) {
+					if (e == expressions.size() - 1) return { InvalidArgumentCount, numToStr(expectedArgNum) };
 
-						if (e == expressions.size() - 1 || (expressions[e + 1].expressions.size() != expectedArgNum && !(expectedArgNum == 1 && expressions[e + 1].type != NestedExpression))) {
-							return { InvalidArgumentCount, numToStr(expectedArgNum) };
-						}
-											
-						const Expression &paramNames = macro.expressions[1];
+					Expression &args = expressions[e + 1];
+					args.simplify();
 
-						MacroRefMap argMacros;
-						
-						if (expectedArgNum == 1 && expressions[e + 1].type != NestedExpression) { // In the case when only 1 argument is expected   macro(x) == macro x
-							argMacros[paramNames.expressions[0].stringVal] = &expressions[e + 1];
-						}
-						else for (int a = 0; a < expectedArgNum; a++) {
-							argMacros[paramNames.expressions[a].stringVal] = &expressions[e + 1].expressions[a];
-						}
+					bool singleArg = expectedArgNum == 1 && args.type != NestedExpression; // In the case when only 1 argument is expected   macro(x) == macro x
+					if (args.expressions.size() != expectedArgNum && !singleArg) {
+						return { InvalidArgumentCount, numToStr(expectedArgNum) };
+					}
 
-						macroValue.replaceMacroArguments(argMacros);
+					// It will not be possible to do things like:
+					//	%define macro(a b) a * b
+					//	macro(x (y + z)) -> x * y + z
+					// but I doubt anyone will notice, let alone use this, so i'll leave it like this
+					macroValue = expansion->instantiate(&args, singleArg);
 
-						expressions.erase(expressions.begin() + e, expressions.begin() + e + 2);
-					}
-					else {
-						expressions.erase(expressions.begin() + e);
-					}
-					
-					expressions.insert(expressions.begin() + e, macroValue.expressions.begin(), macroValue.expressions.end());
+					expressions.erase(expressions.begin() + e, expressions.begin() + e + 2);
 				}
+				else {
+					macroValue = expansion->instantiate();
+					expressions.erase(expressions.begin() + e);
+				}
+				
+				expressions.insert(expressions.begin() + e, macroValue.begin(), macroValue.end());
 			}			
 		}
 	}
@@ -292,6 +481,96 @@ Result Expression::replaceMacros(const MacroRefMap &macroMap_) {
 	return NoError;
 }
 
+// Operator of a binary operation. Values in an operator position (like in  7 float - 1) used to read as 0 from the union, which is **
+static inline MathOperEnum binaryOper(const Expression &expr_) {
+	return expr_.type == Expression::Operator ? expr_.operVal : ToThePowerOf;
+}
+
+void ExprProgram::compile(const ExprList &list_) {
+	order.clear();
+	opers.clear();
+
+	order.push_back(0);
+	for (uint32_t o = 1; o + 1 < list_.size(); o += 2) {
+		int precedence = operPrecedence[binaryOper(list_[o])];
+		while (!opers.empty() && operPrecedence[binaryOper(list_[opers.back()])] >= precedence) {
+			order.push_back(opers.back());
+			opers.pop_back();
+		}
+		opers.push_back(o);
+		order.push_back(o + 1);
+	}
+	order.insert(order.end(), opers.rbegin(), opers.rend());
+}
+
+Expression ExprProgram::run(const ExprList &list_) {
+	stack.clear();
+
+	for (uint32_t i : order) {
+		if ((i & 1) == 0) {
+			stack.push_back(list_[i]);
+			continue;
+		}
+
+		Expression b = std::move(stack.back());
+		stack.pop_back();
+		stack.back() = Expression::operation(stack.back(), binaryOper(list_[i]), b);
+	}
+
+	return std::move(stack.back());
+}
+
+uint64_t FoldCache::leafKey(const Expression &expr_) {
+	uint32_t payload = 0;
+	switch (expr_.type) {
+	case Expression::Integer: payload = expr_.intVal; break;
+	case Expression::Float: memcpy(&payload, &expr_.floatVal, sizeof(payload)); break;
+	case Expression::Operator: payload = expr_.operVal; break;
+	case Expression::String: payload = expr_.symbol; break;
+	default: return NoKey;
+	}
+	return ((uint64_t)expr_.type << 32) | payload;
+}
+
+const FoldCache::Entry *FoldCache::find(const ExprList &list_, Key &rKey_) {
+	rKey_.begin = keys.size();
+	rKey_.hash = 14695981039346656037ull; // FNV-1a over the leaf keys
+
+	for (auto &e : list_) {
+		uint64_t leaf = leafKey(e);
+		if (leaf == NoKey) { // Not a constant, so it isn't cached
+			keys.resize(rKey_.begin);
+			rKey_.begin = NoEntry;
+			return nullptr;
+		}
+		keys.push_back(leaf);
+		rKey_.hash = (rKey_.hash ^ leaf) * 1099511628211ull;
+	}
+
+	auto it = buckets.find(rKey_.hash);
+	if (it != buckets.end()) {
+		for (uint32_t i = it->second; i != NoEntry; i = entries[i].next) {
+			const Entry &entry = entries[i];
+			if (entry.keySize == list_.size() && std::equal(keys.begin() + entry.keyBegin, keys.begin() + entry.keyBegin + entry.keySize, keys.begin() + rKey_.begin)) {
+				keys.resize(rKey_.begin);
+				hits++;
+				return &entry;
+			}
+		}
+	}
+
+	misses++;
+	return nullptr; // The key stays in keys for insert()
+}
+
+void FoldCache::insert(const Key &key_, uint32_t size_, const Expression &result_, bool simplified_) {
+	if (key_.begin == NoEntry) return;
+
+	uint32_t &head = buckets.try_emplace(key_.hash, NoEntry).first->second;
+	entries.push_back({ result_, key_.begin, size_, head, simplified_ });
+	head = entries.size() - 1;
+}
+
 //	!! Macros are not replaced in this function !!
 //		     It should be done before
 
@@ -299,7 +578,7 @@ bool Expression::simplify(bool keepOperationOrder_) {
 	if (type == Invalid || type == Identifier) return false;
 
 	if (type == NestedExpression) {
-		if (expressions.empty()) return false;
+		if (expressions.empty() || canonical) return false;
 				
 		if (expressions.size() == 1) {
 			if (expressions[0].simplify(keepOperationOrder_)) {
@@ -307,6 +586,7 @@ bool Expression::simplify(bool keepOperationOrder_) {
 				return true;
 			}
 			else {
+				canonical = true;
 				return false;
 			}
 
@@ -316,127 +596,154 @@ bool Expression::simplify(bool keepOperationOrder_) {
 		bool allSimplified = true;
 		for (auto &e : expressions)
 			allSimplified &= e.simplify(keepOperationOrder_);
-		if (!allSimplified) return false;
-
-		bool containsIdentifiers = false;
-		for (int e = expressions.size() - 2; e >= 0; e--) {
-			if (expressions[e].type == Operator) {
-				switch (expressions[e].operVal) {
-				case MakeInt:
-					expressions[e + 1] = expressions[e + 1].toInt();
-					expressions.erase(expressions.begin() + e);
-					break;
+		if (!allSimplified) {
+			canonical = true;
+			return false;
+		}
 
-				case MakeFloat:
-					expressions[e + 1] = expressions[e + 1].toFloat();
-					expressions.erase(expressions.begin() + e);
-					break;
+		if (!foldCache || !keepOperationOrder_) return foldValues(keepOperationOrder_);
 
-				case MakeString:
-					expressions[e + 1] = expressions[e + 1].toString();
-					expressions.erase(expressions.begin() + e);
-					break;
+		FoldCache::Key key;
+		if (const FoldCache::Entry *entry = foldCache->find(expressions, key)) {
+			*this = entry->result;
+			return entry->simplified;
+		}
 
-				case MakeIdenitifier:
-					if (expressions[e + 1].type != String) { // Expression::Identifier is not included because all identifiers should eventually be replaced.
-						*this = toInvalid();
-						return false;
-					}
-					expressions[e + 1].type = Identifier;
-					expressions.erase(expressions.begin() + e);
+		uint32_t size = expressions.size();
+		bool simplified = foldValues(keepOperationOrder_);
+		foldCache->insert(key, size, *this, simplified);
+		return simplified;
+	}
 
-					containsIdentifiers = true;
+	return true;
+}
 
-					do e--; while (e >= 0 && expressions[e].type == Operator);
+// Second half of simplify(), for a list of simplified values and operators
+bool Expression::foldValues(bool keepOperationOrder_) {
+	bool containsIdentifiers = false;
+	size_t w = expressions.size() - 1; // Processed elements are packed at the end, [w] is the one after the current operator
+	for (int e = expressions.size() - 2; e >= 0; e--) {
+		if (expressions[e].type == Operator) {
+			Expression &next = expressions[w];
+			switch (expressions[e].operVal) {
+			case MakeInt:
+				next = next.toInt();
+				continue;
+
+			case MakeFloat:
+				next = next.toFloat();
+				continue;
+
+			case MakeString:
+				next = next.toString();
+				continue;
+
+			case MakeIdenitifier:
+				if (next.type != String) { // Expression::Identifier is not included because all identifiers should eventually be replaced.
+					*this = toInvalid();
+					return false;
+				}
+				next.type = Identifier; // Same text, so the symbol stays
 
-					break;
+				containsIdentifiers = true;
 
-				case Not: // ! will work on anything, so it's processed before -
-					expressions[e + 1] = !expressions[e + 1].toBool().intVal;
-					expressions.erase(expressions.begin() + e);
-					break;
+				while (--e >= 0) { // Operators before it, and the operand before them, are kept as they are
+					bool isOperator = expressions[e].type == Operator;
+					if (--w != e) expressions[w] = std::move(expressions[e]);
+					if (!isOperator) break;
 				}
+
+				continue;
+
+			case Not: // ! will work on anything, so it's processed before -
+				next = !next.toBool().intVal;
+				continue;
 			}
 		}
 
-		if (containsIdentifiers)
-			return false;
+		if (--w != e) expressions[w] = std::move(expressions[e]);
+	}
+	expressions.erase(expressions.begin(), expressions.begin() + w);
 
-		if (expressions.size() == 1) {
-			*this = Expression(expressions[0]);
-			return true;
-		}
+	if (containsIdentifiers) {
+		canonical = true;
+		return false;
+	}
 
-		for (int e = expressions.size() - 2; e >= 0; e--) {
-			if (expressions[e].type == Operator && (e == 0 || expressions[e - 1].type == Operator)) {
-				switch (expressions[e].operVal) {
-				case BinNot:
-					if (expressions[e + 1].type != Integer) {
-						*this = toInvalid();
-						return false;
-					}
-					expressions[e + 1] = Expression(~expressions[e + 1].intVal);
-					break;
+	if (expressions.size() == 1) {
+		*this = Expression(expressions[0]);
+		return true;
+	}
 
-				case Minus:
-					switch (expressions[e + 1].type) {
-					case Integer:
-						expressions[e + 1].intVal = -expressions[e + 1].intVal;
-						break;
-					case Float:
-						expressions[e + 1].floatVal = -expressions[e + 1].floatVal;
-						break;
-					default:
-						*this = toInvalid();
-						return false;
-					}
-					break;
+	w = expressions.size() - 1;
+	for (int e = expressions.size() - 2; e >= 0; e--) {
+		if (expressions[e].type == Operator && (e == 0 || expressions[e - 1].type == Operator)) {
+			Expression &next = expressions[w];
+			switch (expressions[e].operVal) {
+			case BinNot:
+				if (next.type != Integer) {
+					*this = toInvalid();
+					return false;
+				}
+				next = Expression(~next.intVal);
+				break;
 
-				default: // All other 1-operand operators were removed ealier
+			case Minus:
+				switch (next.type) {
+				case Integer:
+					next.intVal = -next.intVal;
+					break;
+				case Float:
+					next.floatVal = -next.floatVal;
+					break;
+				default:
 					*this = toInvalid();
 					return false;
 				}
+				break;
 
-				expressions.erase(expressions.begin() + e);
+			default: // All other 1-operand operators were removed ealier
+				*this = toInvalid();
+				return false;
 			}
+			continue;
 		}
 
-		if (expressions.size() == 1) {
-			*this = Expression(expressions[0]);
-			return true;
-		}
+		if (--w != e) expressions[w] = std::move(expressions[e]);
+	}
+	expressions.erase(expressions.begin(), expressions.begin() + w);
+
+	if (expressions.size() == 1) {
+		*this = Expression(expressions[0]);
+		return true;
+	}
 
-		// VVV We are left with an insimplifable list of floats, ints and opers, ... and other things, ... but we can do operation on all of them, so it's fine VVV
+	// VVV We are left with an insimplifable list of floats, ints and opers, ... and other things, ... but we can do operation on all of them, so it's fine VVV
 
-		if ((expressions.size() & 1) == 0) { // A x B x C ... D   -> size() should odd
+	if ((expressions.size() & 1) == 0) { // A x B x C ... D   -> size() should odd
+		return false;
+	}
+
+	for (int e = 0; e < expressions.size(); e++) {
+		if ((e % 2 == 0 && expressions[e].type == Operator) ||
+			(e % 2 == 1 && (expressions[e].type == Integer || expressions[e].type == Float || expressions[e].type == String))) {
 			return false;
 		}
+	}
 
-		for (int e = 0; e < expressions.size(); e++) {
-			if ((e % 2 == 0 && expressions[e].type == Operator) ||
-				(e % 2 == 1 && (expressions[e].type == Integer || expressions[e].type == Float || expressions[e].type == String))) {
-				return false;
-			}
-		}
+	if (keepOperationOrder_) {
 
-		if (keepOperationOrder_) {
+		thread_local ExprProgram program; // Reused, so it doesn't allocate once it has grown
+		program.compile(expressions);
+		expressions[0] = program.run(expressions);
 
-			while (expressions.size() != 1) { // This can be done more efficiently, but i'm too lazy/tired/dumb to do this ;)
-				int e = 0;
-				while (e + 3 < expressions.size() && operPrecedence[expressions[e + 1].operVal] < operPrecedence[expressions[e + 3].operVal]) e += 2;
-				expressions[e] = operation(expressions[e], expressions[e + 1].operVal, expressions[e + 2]);
-				expressions.erase(expressions.begin() + e + 1, expressions.begin() + e + 3);
-			}
-			
-		}
-		else {
-			for (int e = 0; e + 2 < expressions.size(); e += 2)
-				expressions[0] = operation(expressions[0], expressions[e + 1].operVal, expressions[e + 2]);
-		}
-
-		*this = Expression(expressions[0]);
+	}
+	else {
+		for (int e = 0; e + 2 < expressions.size(); e += 2)
+			expressions[0] = operation(expressions[0], binaryOper(expressions[e + 1]), expressions[e + 2]);
 	}
 
+	*this = Expression(expressions[0]);
 	return true;
 }
 
@@ -447,21 +754,13 @@ Expression Expression::toString(bool removeTrailingZeros_) const {
 	case Expression::Type::Float: return Expression::makeString(numToStr(floatVal, std::chars_format::fixed, removeTrailingZeros_));
 	case Expression::Type::String:
 	case Expression::Type::Identifier:
-	case Expression::Type::Invalid: return Expression::makeString(stringVal);
-	case Expression::Type::NestedExpression: return Expression::makeString("(...)");
-	case Expression::Type::Operator: {
-		const char *operStrs[] {
-			"**", "*", "/", "%",
-			"+", "-", ">>", "<<",
-			">", "<", ">=", "<=",
-			"==", "!=", "&", "^",
-			"|", "~", "&&", "||",
-			"!", "int", "float",
-			"string", "id"
-		};
-
-		return Expression::makeString(operVal < InvalidOper ? operStrs[operVal] : "<inv_oper>");
+	case Expression::Type::Invalid: {
+		Expression result = *this;
+		result.type = Expression::Type::String;
+		return result;
 	}
+	case Expression::Type::NestedExpression: return Expression::makeString("(...)");
+	case Expression::Type::Operator: return Expression::makeString(operVal < InvalidOper ? string(operStrs[operVal]) : "<inv_oper>");
 	default: return toInvalid();
 	}
 }
@@ -472,7 +771,7 @@ Expression Expression::toFloat() const {
 	case Expression::Type::Float: return *this;
 	case Expression::Type::String: {
 		float val;
-		if (!strToNum(stringVal, val)) return toInvalid();
+		if (!strToNum(str(), val)) return toInvalid();
 		return val;
 	}
 	default: return toInvalid();
@@ -485,7 +784,7 @@ Expression Expression::toInt() const {
 	case Expression::Type::Float: return (int)floatVal;
 	case Expression::Type::String: {
 		int val;
-		if (!strToNum(stringVal, val)) return toInvalid();
+		if (!strToNum(str(), val)) return toInvalid();
 		return val;
 	}
 	default: return toInvalid();
@@ -494,8 +793,10 @@ Expression Expression::toInt() const {
 
 static inline void removeIdentifiers(Expression &rExpr_) {
 	if (rExpr_.type == Expression::Type::Identifier) rExpr_ = rExpr_.toString();
-	if (rExpr_.type == Expression::Type::NestedExpression)
+	if (rExpr_.type == Expression::Type::NestedExpression) {
+		rExpr_.canonical = false;
 		for (auto &e : rExpr_.expressions) removeIdentifiers(e);
+	}
 }
 
 Expression Expression::toBool() const {
@@ -512,6 +813,8 @@ Expression Expression::toBool() const {
 	case Expression::Type::Invalid:
 	case Expression::Type::Operator: return toInvalid();
 	}
+
+	return toInvalid();
 }
 
 Expression Expression::toInvalid() const {
@@ -520,25 +823,30 @@ Expression Expression::toInvalid() const {
 	return result;
 }
 
+// Values that aren't numbers count as 0. toInvalid() keeps the text in the union, so its floatVal can't be used
+static inline float floatOrZero(const Expression &expr_) {
+	Expression result = expr_.toFloat();
+	return result.type == Expression::Type::Float ? result.floatVal : 0.f;
+}
+
 Expression Expression::operation(const Expression &a_, MathOperEnum oper_, const Expression &b_) {
 	if (a_.type == Expression::Type::Invalid || b_.type == Expression::Type::Invalid) return Expression();
 
 	if (oper_ == Plus && (a_.type == Expression::Type::String || b_.type == Expression::Type::String))
-		return Expression::makeString(a_.toString().stringVal + b_.toString().stringVal);
+		return Expression::makeString(a_.toString().str() + b_.toString().str());
 	if (oper_ == Times && (a_.type == Expression::Type::String && b_.type == Expression::Type::Integer)) {
-		Expression result;
-		result.type = Expression::Type::String;
+		string result;
 		for (int i = 0; i < b_.intVal; i++)
-			result.stringVal += a_.stringVal;
-		return result;
+			result += a_.str();
+		return Expression::makeString(result);
 	}
 		
 	if (a_.type == Expression::Type::String && b_.type == Expression::Type::String)
-		return calcStrStr(a_.stringVal, oper_, b_.stringVal);
+		return calcStrStr(a_.str(), oper_, b_.str());
 	if (a_.type == Expression::Type::Integer && b_.type == Expression::Type::Integer)
 		return calcIntInt(a_.toInt().intVal, oper_, b_.toInt().intVal);
 	
-	return calcFloatFloat(a_.toFloat().floatVal, oper_, b_.toFloat().floatVal);
+	return calcFloatFloat(floatOrZero(a_), oper_, floatOrZero(b_));
 }
 
 Expression Expression::calcStrStr(const string &a_, MathOperEnum oper_, const string &b_) {
@@ -594,7 +902,7 @@ Expression Expression::calcFloatFloat(float a_, MathOperEnum oper_, float b_) {
 	case Minus:					return Expression(a_ - b_);
 	case Times:					return Expression(a_ * b_);
 	case DividedBy:				return Expression(a_ / b_);
-	case ToThePowerOf:			return Expression(pow(a_, b_));
+	case ToThePowerOf:			return Expression(std::pow(a_, b_));
 
 	case IsEqualTo:				return Expression(a_ == b_);
 	case IsNotEqualTo:			return Expression(a_ != b_);
@@ -608,45 +916,4 @@ Expression Expression::calcFloatFloat(float a_, MathOperEnum oper_, float b_) {
 	}
 
 	return Expression();
-}
-
-const unordered_map<string, MathOperEnum> Expression::operStrToEnum{
-	{ "**", ToThePowerOf },
-	
-	{ "*", Times },
-	{ "/", DividedBy },
-	{ "%", Modulo },
-
-	{ "+", Plus },
-	{ "-", Minus },
-	
-	{ ">>", BitShR },
-	{ "<<", BitShL },
-
-	{ ">", IsGreaterThan },
-	{ "<", IsLessThan },
-	{ ">=", IsGreaterOrEqualTo },
-	{ "<=", IsLessOrEqualTo },
-
-	{ "==", IsEqualTo },
-	{ "!=", IsNotEqualTo },
-
-	{ "&", BinAnd },
-
-	{ "^", BinXor },
-
-	{ "|", BinOr },
-
-	{ "~", BinNot },
-
-	{ "&&", And },
-
-	{ "||", Or },
-
-	{ "!", Not },
-
-	{ "int", MakeInt },
-	{ "float", MakeFloat },
-	{ "string", MakeString },
-	{ "id", MakeIdenitifier }
-};
\ No newline at end of file
+}
\ No newline at end of file
@@ -10,17 +10,52 @@ inline bool strStartsWith(const string &str_, const string &starts_, size_t off_
 	return true;
 }
 
+enum CharClass : uint8_t {
+	CharDelimiter = 1 << 0,		// ' ' '\t'
+	CharName = 1 << 1,			// a-z A-Z 0-9 _ . %
+	CharQuote = 1 << 2,			// " '
+	CharParenthesis = 1 << 3,	// (
+	CharBracket = 1 << 4,		// [ { <
+	CharClosing = 1 << 5		// )
+};
+
+struct CharClassTable {
+	uint8_t classes[256];
+	char closing[256]; // Closing character for every bracket
+
+	constexpr CharClassTable() : classes(), closing() {
+		for (int c = 'a'; c <= 'z'; c++) classes[c] |= CharName;
+		for (int c = 'A'; c <= 'Z'; c++) classes[c] |= CharName;
+		for (int c = '0'; c <= '9'; c++) classes[c] |= CharName;
+		classes['_'] |= CharName;
+		classes['.'] |= CharName; // '.' for file extensions and floats
+		classes['%'] |= CharName; // '%' for compiler macros
+
+		classes[' '] |= CharDelimiter;
+		classes['\t'] |= CharDelimiter;
+
+		classes['"'] |= CharQuote;
+		classes['\''] |= CharQuote;
+
+		classes['('] |= CharParenthesis;
+		classes[')'] |= CharClosing;
+		classes['['] |= CharBracket; closing['['] = ']';
+		classes['{'] |= CharBracket; closing['{'] = '}';
+		classes['<'] |= CharBracket; closing['<'] = '>';
+	}
+
+	constexpr bool is(char ch_, uint8_t class_) const {
+		return classes[(uint8_t)ch_] & class_;
+	}
+};
+
+inline constexpr CharClassTable charClasses;
+
 inline bool isPartOfName(char ch_) {
-	return
-		(ch_ >= 'a' && ch_ <= 'z') ||
-		(ch_ >= 'A' && ch_ <= 'Z') ||
-		(ch_ >= '0' && ch_ <= '9') ||
-		ch_ == '_' || ch_ == '.' || ch_ == '%';
-		// '.' for file extensions and floats
-		// '%' for compiler macros
+	return charClasses.is(ch_, CharName);
 }
 
-inline bool isNameValid(const string &str_) {
+inline bool isNameValid(std::string_view str_) {
 	if (str_.empty()) return false;
 	if (str_[0] >= '0' && str_[0] <= '9') return false;
 	for (int i = 0; i < str_.size(); i++)
@@ -28,33 +63,39 @@ inline bool isNameValid(const string &str_) {
 	return true;
 }
 
-inline bool isOneOf(const char char_, const char *list_, int checkEvery_ = 1) { // if strlen(list_) % checkEvery_ != 0 it will crash.
-	for (const char *c = list_; *c != '\0'; c += checkEvery_)
-		if (char_ == *c) return true;
-	return false;
-}
-
-void removeComments(vector<string> &rScript_, const string &singleLineCommentBegin_ = "//", const string &multilineCommentBegin_ = "/*", const string &multilineCommentEnd_ = "*/");
+struct ScriptLine {
+	size_t begin;
+	size_t end;
+};
 
-void getNextToken(const char *&rTokBeg_, const char *&rTokEnd_, const char *end_, const char *delim_ = " \t", const char *range_ = "()[]{}<>", const char *string_ = "\"'");
+struct ScriptBuffer {
+	string text; // The whole file, read in one go. Lines are only indexed, never copied out.
+	vector<ScriptLine> lines;
+};
 
-vector<string> split(const char *begin_, const char *end_, const char *delim_ = " \t", const char *range_ = "()[]{}<>", const char *string_ = "\"'");
+enum TokenType {
+	TokenAtom,			// name, number, operator or string
+	TokenGroupBegin,	// (
+	TokenGroupEnd,		// )
+	TokenRange			// [...] {...} <...>
+};
 
-inline void prepareScript(vector<string> &rScript_) {
-	if (rScript_.empty()) return;
+// Splits a line into tokens without copying them.
+// Parentheses are returned as separate tokens, so that groups can be parsed in the same pass.
+// Other brackets only open ranges outside of parentheses when splitting whole lines, and such ranges are returned as single tokens.
+struct Lexer {
+	const char *pos;
+	const char *end;
+	bool splitRanges;
+	int depth = 0;
 
-	removeComments(rScript_);
+	Lexer(const char *begin_, const char *end_, bool splitRanges_) : pos(begin_), end(end_), splitRanges(splitRanges_) {}
 
-	if (!rScript_.back().empty() && rScript_.back().back() == '\\') rScript_.back().pop_back();
-	for (int i = rScript_.size() - 2; i >= 0; i--) {
-		if (!rScript_[i].empty() && rScript_[i].back() == '\\') {
-			rScript_[i].pop_back();
-			rScript_[i] += rScript_[i + 1];
-			rScript_[i + 1].clear();
-		}
-	}
+	bool next(std::string_view &rTok_, TokenType &rType_);
 };
 
+void prepareScript(ScriptBuffer &rScript_, std::string_view singleLineCommentBegin_ = "//", std::string_view multilineCommentBegin_ = "/*", std::string_view multilineCommentEnd_ = "*/");
+
 template <typename T>
 inline string numToStr(T val_, std::chars_format format_ = std::chars_format::fixed, int precision_ = 6, bool removeTrailingZeros_ = false) {
 	char buf[64];
@@ -74,7 +115,7 @@ inline string numToStr(T val_, std::chars_format format_ = std::chars_format::fi
 		result = std::to_chars(buf, buf + sizeof(buf), val_);
 	}
 	else {
-		static_assert(false, "Invalid type passed to numToStr().");
+		static_assert(sizeof(T) == 0, "Invalid type passed to numToStr().");
 	}
 
 	return string(buf, result.ptr);
@@ -105,7 +146,7 @@ bool strToNum(const string &str_, T &rVal_, size_t off_ = 0, bool allowPrefixes_
 		result = std::from_chars(begin, end, tmp, fmt_);
 	}
 	else {
-		static_assert(false, "Invalid type passed to strToNum().");
+		static_assert(sizeof(T) == 0, "Invalid type passed to strToNum().");
 	}
 
 	if (result.ptr != end || result.ec != std::errc{}) return 0;
@@ -149,9 +190,198 @@ static constexpr int operPrecedence[]{
 	3, 3, 3
 };
 
+static constexpr std::string_view operStrs[]{
+	"**", "*", "/", "%",
+	"+", "-", ">>", "<<",
+	">", "<", ">=", "<=",
+	"==", "!=", "&", "^",
+	"|", "~", "&&", "||",
+	"!", "int", "float",
+	"string", "id"
+};
+
+// Perfect hash of all operator strings. The table is built at compile time, so a collision won't compile.
+constexpr size_t operHash(std::string_view str_) {
+	return ((uint8_t)str_[0] + ((str_.size() > 1 ? (uint8_t)str_[1] : 0) << 3) + str_.size()) % 55;
+}
+
+struct OperHashTable {
+	MathOperEnum slots[55];
+
+	constexpr OperHashTable() : slots() {
+		for (auto &s : slots) s = InvalidOper;
+		for (unsigned int o = 0; o < InvalidOper; o++) {
+			if (slots[operHash(operStrs[o])] != InvalidOper) throw "Operator hash collision";
+			slots[operHash(operStrs[o])] = (MathOperEnum)o;
+		}
+	}
+};
+
+inline constexpr OperHashTable operHashTable;
+
+enum DirectiveEnum : unsigned int {
+	DirDefine, DirUndef, DirInclude,
+	DirIf, DirEndif,
+	DirFileDef, DirFileEnd, DirFilePush, DirFilePop,
+	DirInherit, DirMarker, DirSkipTo, DirAlign, DirError,
+	DirOnce, DirElse, DirElif, DirMnemonic,
+
+	InvalidDirective
+};
+
+static constexpr std::string_view directiveStrs[]{
+	"%define", "%undef", "%include",
+	"%if", "%endif",
+	"%file_def", "%file_end", "%file_push", "%file_pop",
+	"%inherit", "%marker", "%skip_to", "%align", "%error",
+	"%once", "%else", "%elif", "%mnemonic"
+};
+
+constexpr size_t directiveHash(std::string_view str_) {
+	return (str_.size() + (uint8_t)str_[1] * 3 + (uint8_t)str_.back() * 2) % 32;
+}
+
+struct DirectiveHashTable {
+	DirectiveEnum slots[32];
+
+	constexpr DirectiveHashTable() : slots() {
+		for (auto &s : slots) s = InvalidDirective;
+		for (unsigned int d = 0; d < InvalidDirective; d++) {
+			if (slots[directiveHash(directiveStrs[d])] != InvalidDirective) throw "Directive hash collision";
+			slots[directiveHash(directiveStrs[d])] = (DirectiveEnum)d;
+		}
+	}
+};
+
+inline constexpr DirectiveHashTable directiveHashTable;
+
+inline DirectiveEnum getDirectiveEnum(std::string_view str_) {
+	if (str_.size() < 2) return InvalidDirective;
+	DirectiveEnum dir = directiveHashTable.slots[directiveHash(str_)];
+	return dir != InvalidDirective && directiveStrs[dir] == str_ ? dir : InvalidDirective;
+}
+
+using Symbol = uint32_t;
+
+// Identifiers are interned when they are lexed, so macro and label lookups compare ids instead of hashing names
+class SymbolTable {
+public:
+	SymbolTable() { intern(""); } // Symbol 0 is the empty name
+
+	Symbol intern(std::string_view str_) {
+		if (shared) {
+			std::unique_lock lock(mutex);
+			return internUnlocked(str_);
+		}
+		return internUnlocked(str_);
+	}
+
+	const string &name(Symbol sym_) const {
+		if (shared) {
+			std::shared_lock lock(mutex);
+			return names[sym_];
+		}
+		return names[sym_];
+	}
+
+	// Set while other threads use the table too. Only then the calls lock
+	void setShared(bool shared_) { shared = shared_; }
+
+private:
+	unordered_map<std::string_view, Symbol> ids;
+	deque<string> names;
+	mutable std::shared_mutex mutex;
+	bool shared = false;
+
+	Symbol internUnlocked(std::string_view str_) {
+		auto it = ids.find(str_);
+		if (it != ids.end()) return it->second;
+
+		Symbol sym = (Symbol)names.size();
+		const string &name = names.emplace_back(str_); // deque never moves its elements, so the key view stays valid
+		ids.emplace(std::string_view(name), sym);
+		return sym;
+	}
+};
+
+inline SymbolTable symbols;
+
 struct Expression;
-using MacroRefMap = unordered_map<string, const Expression*>;
-using MacroMap = unordered_map<string, Expression>;
+class MacroTable;
+
+struct MacroUse { // A macro lookup and the definition it found
+	Symbol sym;
+	uint32_t macroId; // 0 if there was none
+};
+
+// Expression nodes are allocated from this resource. main() points it at a pool that lives for the whole compilation.
+// Other threads use new/delete, so the nodes they create must also be destroyed by them.
+inline thread_local std::pmr::memory_resource *exprArena = std::pmr::new_delete_resource();
+
+// Child list of an Expression. It's a vector cut down to 16 bytes (no allocator or 64-bit sizes), with storage from exprArena.
+class ExprList {
+public:
+	using iterator = Expression*;
+	using const_iterator = const Expression*;
+
+	ExprList() {}
+	ExprList(const Expression *first_, const Expression *last_);
+	ExprList(std::initializer_list<Expression> exprs_);
+	ExprList(const ExprList &other_);
+	ExprList(ExprList &&other_) noexcept : data(other_.data), count(other_.count), cap(other_.cap) {
+		other_.data = nullptr;
+		other_.count = other_.cap = 0;
+	}
+	~ExprList();
+
+	ExprList &operator=(const ExprList &other_) {
+		if (this != &other_) {
+			ExprList copy(other_);
+			swap(copy);
+		}
+		return *this;
+	}
+	ExprList &operator=(ExprList &&other_) noexcept {
+		ExprList moved(std::move(other_)); // The old children are destroyed only after other_ was taken, in case other_ is one of them
+		swap(moved);
+		return *this;
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	// Defined below Expression, they need the complete type
+	Expression &operator[](size_t i_);
+	const Expression &operator[](size_t i_) const;
+	Expression &front();
+	const Expression &front() const;
+	Expression &back();
+	const Expression &back() const;
+
+	iterator begin() { return data; }
+	iterator end();
+	const_iterator begin() const { return data; }
+	const_iterator end() const;
+
+	void reserve(size_t cap_);
+	void clear();
+	void push_back(Expression expr_);
+	iterator insert(const_iterator pos_, const Expression *first_, const Expression *last_);
+	iterator erase(const_iterator pos_);
+	iterator erase(const_iterator first_, const_iterator last_);
+
+	void swap(ExprList &other_) noexcept {
+		std::swap(data, other_.data);
+		std::swap(count, other_.count);
+		std::swap(cap, other_.cap);
+	}
+
+private:
+	Expression *data = nullptr;
+	uint32_t count = 0;
+	uint32_t cap = 0;
+};
+
 
 struct Expression {
 public:
@@ -188,7 +418,7 @@ public:
 	
 	*/
 
-	enum Type {
+	enum Type : uint8_t {
 		Integer, // 1 39 92
 		Float, // 1.453465
 		Identifier, // variable_name
@@ -196,49 +426,52 @@ public:
 		NestedExpression, // (+variable +(6 * 90^2) -...)
 		Operator, // + - || >= !
 		Invalid // 123abcz #aaa my:variable
-	} type;
+	};
 
-	vector<Expression> expressions;
-	string stringVal;
+	ExprList expressions;
 	union {
 		int intVal = 0;
 		float floatVal;
 		MathOperEnum operVal;
+		Symbol symbol; // Text of identifiers, strings and invalid tokens
 	};
+	Type type;
+	bool canonical = false; // simplify() has already failed on this list (it still depends on identifiers) and the list hasn't changed since
+
+	const string &str() const { return symbols.name(hasText() ? symbol : 0); }
+	bool hasText() const { return type == Identifier || type == String || type == Invalid; }
 
 	Expression(const char *begin_, const char *end_) {
 		parse(begin_, end_);
 	}
-	Expression(const string &str_) {
+	Expression(std::string_view str_) {
 		parse(str_.data(), str_.data() + str_.size());
 	}
 
-	static Expression makeIdentifier(const string &stringVal_) {
+	static Expression makeIdentifier(std::string_view str_) {
 		Expression expr;
-		expr.stringVal = stringVal_;
+		expr.symbol = symbols.intern(str_);
 		expr.type = Identifier;
 		return expr;
 	}
 
-	static Expression makeString(const string &stringVal_) {
+	static Expression makeString(std::string_view str_) {
 		Expression expr;
-		expr.stringVal = stringVal_;
+		expr.symbol = symbols.intern(str_);
 		expr.type = String;
 		return expr;
 	}
 
-	Expression(const vector<Expression> &exprs_) : type(NestedExpression), expressions(exprs_) {}
-	Expression(const vector<string> &strs_) : type(NestedExpression) {
-		for (auto &s : strs_)
-			expressions.push_back(s);
-	}
+	static Expression parseLine(const char *begin_, const char *end_);
+
+	Expression(ExprList exprs_) : expressions(std::move(exprs_)), type(NestedExpression) {}
 
-	Expression(const string &str_, const vector<Expression> &exprs_) : type(Identifier), expressions(exprs_), stringVal(str_) {}
+	Expression(const string &str_, ExprList exprs_) : expressions(std::move(exprs_)), symbol(symbols.intern(str_)), type(Identifier) {}
 
-	Expression() : type(Expression::Type::Invalid), intVal(0) {}
+	Expression() : intVal(0), type(Expression::Type::Invalid) {}
 
-	Expression(float f_) : type(Expression::Type::Float), floatVal(f_) {}
-	Expression(int i_) : type(Expression::Type::Integer), intVal(i_) {}
+	Expression(float f_) : floatVal(f_), type(Expression::Type::Float) {}
+	Expression(int i_) : intVal(i_), type(Expression::Type::Integer) {}
 
 	Expression(const Expression &a_, const Expression &b_, MathOperEnum &oper_) { *this = operation(a_, oper_, b_); }
 	Expression(const Expression &a_, const Expression &b_, const string &oper_) { *this = operation(a_, getOperEnum(oper_), b_); }
@@ -261,33 +494,239 @@ public:
 	};
 	
 	//int replaceMacroNoParams(const Expression &macro_);
-	Result replaceMacros(const MacroRefMap &macroMap_);
-	void replaceMacroArguments(const MacroRefMap &argMap_);
+	Result replaceMacros(const MacroTable &macros_, vector<MacroUse> *pUses_ = nullptr, const vector<Symbol> *pSkipped_ = nullptr); // pUses_ collects every lookup, identifiers in pSkipped_ are left as they are
 	bool simplify(bool keepOperationOrder_ = true);
 
 	static Expression operation(const Expression &a_, MathOperEnum oper_, const Expression &b_);
 
-	static inline MathOperEnum getOperEnum(const string &str_) {
-		auto it = operStrToEnum.find(str_);
-		if (it == operStrToEnum.end()) return MathOperEnum::InvalidOper;
-		return it->second;
+	static inline MathOperEnum getOperEnum(std::string_view str_) {
+		if (str_.empty()) return MathOperEnum::InvalidOper;
+		MathOperEnum oper = operHashTable.slots[operHash(str_)];
+		return oper != MathOperEnum::InvalidOper && operStrs[oper] == str_ ? oper : MathOperEnum::InvalidOper;
 	}
 
 private:
 
-	static const unordered_map<string, MathOperEnum> operStrToEnum;
-
 	static Expression calcIntInt(int a_, MathOperEnum oper_, int b_);
 	static Expression calcFloatFloat(float a_, MathOperEnum oper_, float b_);
 	static Expression calcStrStr(const string &a_, MathOperEnum oper_, const string &b_);
 
+	bool foldValues(bool keepOperationOrder_);
+
 	bool parse(const char *begin_, const char *end_);
+	bool parseAtom(std::string_view str_);
+
+	static bool parseList(Lexer &rLexer_, ExprList &rExprs_);
+	static Expression parseElement(Lexer &rLexer_, std::string_view tok_, TokenType type_);
+
+};
+
+inline ExprList::ExprList(const Expression *first_, const Expression *last_) {
+	reserve(last_ - first_);
+	std::uninitialized_copy(first_, last_, data);
+	count = (uint32_t)(last_ - first_);
+}
+
+inline ExprList::ExprList(std::initializer_list<Expression> exprs_) : ExprList(exprs_.begin(), exprs_.end()) {}
+inline ExprList::ExprList(const ExprList &other_) : ExprList(other_.begin(), other_.end()) {}
+
+inline Expression &ExprList::operator[](size_t i_) { return data[i_]; }
+inline const Expression &ExprList::operator[](size_t i_) const { return data[i_]; }
+inline Expression &ExprList::front() { return data[0]; }
+inline const Expression &ExprList::front() const { return data[0]; }
+inline Expression &ExprList::back() { return data[count - 1]; }
+inline const Expression &ExprList::back() const { return data[count - 1]; }
+inline ExprList::iterator ExprList::end() { return data + count; }
+inline ExprList::const_iterator ExprList::end() const { return data + count; }
+
+inline ExprList::~ExprList() {
+	clear();
+	if (data) exprArena->deallocate(data, cap * sizeof(Expression), alignof(Expression));
+}
+
+inline void ExprList::reserve(size_t cap_) {
+	if (cap_ <= cap) return;
+
+	Expression *newData = (Expression*)exprArena->allocate(cap_ * sizeof(Expression), alignof(Expression));
+	if (data) {
+		std::uninitialized_move(data, data + count, newData);
+		std::destroy(data, data + count);
+		exprArena->deallocate(data, cap * sizeof(Expression), alignof(Expression));
+	}
+	data = newData;
+	cap = (uint32_t)cap_;
+}
+
+inline void ExprList::clear() {
+	std::destroy(data, data + count);
+	count = 0;
+}
+
+inline void ExprList::push_back(Expression expr_) { // By value, so pushing one of our own elements is safe
+	if (count == cap) reserve(cap ? cap * 2 : 4);
+	new (data + count) Expression(std::move(expr_));
+	count++;
+}
+
+inline ExprList::iterator ExprList::insert(const_iterator pos_, const Expression *first_, const Expression *last_) {
+	size_t idx = pos_ - data, oldCount = count, n = last_ - first_;
+	if (count + n > cap) reserve(std::max<size_t>(cap * 2, count + n));
+
+	std::uninitialized_copy(first_, last_, data + count); // Append, then rotate into place
+	count += (uint32_t)n;
+	std::rotate(data + idx, data + oldCount, data + count);
+	return data + idx;
+}
+
+inline ExprList::iterator ExprList::erase(const_iterator pos_) { return erase(pos_, pos_ + 1); }
+
+inline ExprList::iterator ExprList::erase(const_iterator first_, const_iterator last_) {
+	Expression *first = data + (first_ - data), *last = data + (last_ - data);
+	Expression *newEnd = std::move(last, end(), first);
+	std::destroy(newEnd, end());
+	count = (uint32_t)(newEnd - data);
+	return first;
+}
+
+void tokenizeScript(const ScriptBuffer &script_, vector<Expression> &rTokens_);
+
+// Results of simplify() for lists of constants and operators, so every distinct one is folded once per compilation.
+// Lists are compared by their leaves: type and value, with strings compared by symbol.
+class FoldCache {
+public:
+	static constexpr uint32_t NoEntry = UINT32_MAX;
+
+	struct Key {
+		uint64_t hash;
+		uint32_t begin; // Leaves of a missed list, kept in keys until insert()
+	};
+
+	struct Entry {
+		Expression result;
+		uint32_t keyBegin, keySize;
+		uint32_t next; // Entry with the same hash
+		bool simplified; // Return value of simplify()
+	};
+
+	size_t hits = 0, misses = 0;
+
+	const Entry *find(const ExprList &list_, Key &rKey_);
+	void insert(const Key &key_, uint32_t size_, const Expression &result_, bool simplified_);
+
+private:
+	static constexpr uint64_t NoKey = UINT64_MAX;
+
+	unordered_map<uint64_t, uint32_t> buckets; // Hash -> newest entry
+	vector<uint64_t> keys;
+	vector<Entry> entries;
+
+	static uint64_t leafKey(const Expression &expr_);
+};
+
+// Used by simplify() when set. main() creates one next to the expression arena, since the results are allocated from it.
+// Like the arena it belongs to one thread, the others fold without it.
+inline thread_local FoldCache *foldCache = nullptr;
+
+// Binary operations of a simplified list (operand, oper, operand, ...) in postfix order, built with the shunting-yard algorithm.
+// Operators of the same precedence are applied left to right. The order only depends on the operators, so a program can be run again on other operands.
+class ExprProgram {
+public:
+	void compile(const ExprList &list_);
+	Expression run(const ExprList &list_);
+
+private:
+	vector<uint32_t> order; // Indices into the list, operators are at odd ones
+	vector<uint32_t> opers;
+	vector<Expression> stack;
+};
+
+// Macro value with nested macros already replaced. Identifiers matching a parameter are stored as slots,
+// so an expansion is one copy with the arguments written into the slots.
+struct MacroExpansion {
+	struct Slot {
+		uint32_t param;
+		uint32_t pathBegin, pathEnd; // Child indices leading to the identifier, in paths
+	};
+
+	Expression value;
+	vector<MacroUse> uses; // Lookups made while the nested macros were replaced
+	vector<Slot> slots;
+	vector<uint32_t> paths;
+
+	// Arguments are the elements of args_, or args_ itself if it's the only one and not in brackets
+	ExprList instantiate(const Expression *args_ = nullptr, bool singleArg_ = false) const;
+};
+
+// %define ['global'] ['eval'] <macro>[(params...)] <value...>
+struct Macro {
+	uint32_t id = 0; // Unique for every definition, set by MacroTable
+	Expression value; // Tokens inserted in place of the macro
+	vector<Symbol> params;
+	bool paramsShadowMacros = false; // Parameters are not replaced by macros of the same name (mnemonics)
+
+	Macro(Expression value_, vector<Symbol> params_ = {}) : value(std::move(value_)), params(std::move(params_)) {}
+
+	// The expansion is built once and reused as long as all of its lookups still find the same definitions
+	Result expand(const MacroTable &macros_, const MacroExpansion *&rExpansion_) const;
 
+private:
+	mutable MacroExpansion expansion;
+	mutable bool expanded = false;
+
+	bool isExpansionValid(const MacroTable &macros_) const;
+	void findSlots(const Expression &expr_, vector<uint32_t> &rPath_) const;
 };
 
-void tokenizeScript(vector<string> &rScript_, vector<Expression> &rTokens_);
+// Macros visible from the current file: its local macros shadow the global ones.
+// Every symbol has a chain of local definitions, newest first, so defining, undefining and leaving a file only touch the symbols involved.
+class MacroTable {
+public:
+	MacroTable() { scopes.push_back({}); }
+
+	const Macro *find(Symbol sym_) const;
+	const Macro *findGlobal(Symbol sym_) const { return sym_ < slots.size() ? slots[sym_].global.get() : nullptr; }
+
+	void define(Symbol sym_, Macro macro_, bool global_);
+	void undef(Symbol sym_, bool global_);
+
+	void pushScope(); // Entering a file, it starts without local macros
+	void popScope();
+
+	// %inherit: the parent file's local macros become visible in the current one. They are shared, not copied
+	void inheritAll();
+	bool inherit(Symbol sym_); // False if the parent has no such local macro
+
+private:
+	static constexpr uint32_t NoDef = UINT32_MAX;
+
+	using MacroPtr = std::shared_ptr<const Macro>;
+
+	struct LocalDef {
+		MacroPtr macro; // nullptr after %undef
+		Symbol sym;
+		uint32_t scope;
+		uint32_t prev; // Older definition of the same symbol, or NoDef
+	};
+
+	struct Slot {
+		MacroPtr global;
+		uint32_t local = NoDef; // Newest local definition
+	};
 
-void genFinalMacroMap(MacroRefMap &rMacroMap_, const MacroMap &local_, const MacroMap &global_);
+	struct Scope {
+		uint32_t defBegin = 0; // Definitions of a scope are always on top of the ones of its parent
+		bool inheritsParent = false;
+	};
+
+	vector<Slot> slots; // Indexed by Symbol
+	vector<LocalDef> defs;
+	vector<Scope> scopes;
+	uint32_t lastMacroId = 0;
+
+	Slot &slot(Symbol sym_);
+	uint32_t visibleDef(uint32_t def_, uint32_t scope_) const;
+	void defineLocal(Symbol sym_, MacroPtr macro_);
+};
 
 inline void flattenNestedExpr(Expression &rExpr_) {
 	while (rExpr_.type == Expression::NestedExpression && rExpr_.expressions.size() == 1)
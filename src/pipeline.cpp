@@ -0,0 +1,44 @@
+#include "pipeline.hpp"
+
+Result assembleStream(ScriptReader &rMain_, vector<ProcessedFile> &rFileStack_, CodeStream &rOut_, bool addMarkers_, int &rInstructionCount_) {
+	constexpr size_t pieceBytes = 1 << 16;
+
+	CodeImage code;
+	vector<Marker> markers;
+	Assembler assembler(code, markers, addMarkers_, rFileStack_.front(), 1, true);
+
+	auto pushCode = [&](bool last_) {
+		CodeImage piece;
+		vector<Marker> pieceMarkers;
+		assembler.takeCode(piece, pieceMarkers);
+		if (last_) pieceMarkers.insert(pieceMarkers.end(), std::make_move_iterator(markers.begin()), std::make_move_iterator(markers.end())); // At the end of the image
+
+		rOut_.push(std::move(piece), std::move(pieceMarkers));
+	};
+
+	Result layoutError;
+	vector<ProcessedFile> layoutErrorStack;
+
+	Result result = preprocessor(rMain_, rFileStack_, [&](Expression &rLine_) {
+		if (layoutError.code != NoError) return; // The rest is still preprocessed, its errors come first like without streaming
+
+		layoutError = assembler.add(rLine_);
+		if (layoutError.code != NoError) layoutErrorStack = assembler.fileStack();
+		else if (assembler.finalBytes() >= pieceBytes) pushCode(false);
+	});
+
+	rInstructionCount_ = assembler.instructionCount();
+	if (result.code != NoError) return result;
+
+	if (layoutError.code != NoError) {
+		rFileStack_ = std::move(layoutErrorStack);
+		return layoutError;
+	}
+
+	result = assembler.finish();
+	rFileStack_ = assembler.fileStack();
+	if (result.code != NoError) return result;
+
+	pushCode(true);
+	return {};
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "common.hpp"
+#include "parser.hpp"
+#include "assembler.hpp"
+#include "files.hpp"
+#include "preprocessor.hpp"
+
+// Preprocesses, assembles and writes the program at once. The main file is tokenized a chunk at a time, every line goes to the assembler as soon as the preprocessor is done with it,
+// and the code that can't change any more goes to rOut_, which formats and writes it on its own thread.
+// Only the instructions waiting for a label, and the code after the first of them, stay in memory.
+// The preprocessor and the assembler share the expression arena, so they run on this thread. Instructions are encoded on it as well.
+Result assembleStream(ScriptReader &rMain_, vector<ProcessedFile> &rFileStack_, CodeStream &rOut_, bool addMarkers_, int &rInstructionCount_);
+
+#endif
\ No newline at end of file
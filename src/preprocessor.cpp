@@ -1,24 +1,35 @@
 #include "preprocessor.hpp"
 
-Result preprocessor(vector<Expression> &rScript_, vector<ProcessedFile> &rFileStack_) {
+static Result preprocess(ScriptCursor &cursor, vector<ProcessedFile> &rFileStack_, const LineSink &sink_) {
 
 	Result result = {};
 
-	unordered_map<string, vector<Expression>> files;
+	unordered_map<string, SourceFile> files;
+	unordered_set<string> onceFiles;
+	MnemonicMap mnemonics;
+	bool elifPending = false;
+
+	MacroTable macros;
 
-	MacroMap globalMacros;
-	MacroRefMap macroMap;
+	macros.define(symbols.intern("%argn"), Expression(ExprList{ Expression(0) }), false);
+	macros.define(symbols.intern("%path"), Expression(ExprList{ Expression::makeString(rFileStack_.front().location.path) }), false);
+	macros.define(symbols.intern("%name"), Expression(ExprList{ Expression::makeString(rFileStack_.front().location.name) }), false);
 
-	rFileStack_.front().macros["%argn"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression(0) }) });
-	rFileStack_.front().macros["%path"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression::makeString(rFileStack_.front().location.path) }) });
-	rFileStack_.front().macros["%name"] = Expression(vector<Expression>{ Expression(vector<Expression>{ Expression::makeString(rFileStack_.front().location.name) }) });
+	// Directives only change the current line and the ones after it, so everything read before is done
+	auto nextLine = [&]() {
+		if (sink_) {
+			for (Expression &line : cursor.output) sink_(line);
+			cursor.output.clear();
+		}
+		return cursor.next();
+	};
 
-	for (auto &l : rFileStack_.back().macros)
-		macroMap[l.first] = &l.second;
+	for (; nextLine(); rFileStack_.back().line++) {
 
-	for (int l = 0; l < rScript_.size(); l++, rFileStack_.back().line++) {
+		Expression &thisExpr = cursor.current();
 
-		Expression &thisExpr = rScript_[l];
+		bool elifReached = elifPending; // This line is an %elif after a false branch
+		elifPending = false;
 		
 		if (thisExpr.expressions.empty()) continue;
 
@@ -26,10 +37,12 @@ Result preprocessor(vector<Expression> &rScript_, vector<ProcessedFile> &rFileSt
 
 		if (thisExpr.expressions[0].type == Expression::String && thisExpr.expressions.size() == 1) continue; // String inserted directly - skip everything else
 
-		if (thisExpr.expressions[0].type != Expression::Identifier) return { UnexpectedToken, thisExpr.expressions[0].toString().stringVal };
+		if (thisExpr.expressions[0].type != Expression::Identifier) return { UnexpectedToken, thisExpr.expressions[0].toString().str() };
 		
-		if (thisExpr.expressions[0].stringVal != "%define" && thisExpr.expressions[0].stringVal != "%undef") {
-			Result err = thisExpr.replaceMacros(macroMap);
+		DirectiveEnum directive = getDirectiveEnum(thisExpr.expressions[0].str());
+
+		if (directive != DirDefine && directive != DirUndef && directive != DirMnemonic) {
+			Result err = thisExpr.replaceMacros(macros);
 			if (err.code != NoError) return err;
 			if (thisExpr.expressions.empty()) continue;
 		}
@@ -37,69 +50,111 @@ Result preprocessor(vector<Expression> &rScript_, vector<ProcessedFile> &rFileSt
 		for (int e = 1; e < thisExpr.expressions.size(); e++)
 			thisExpr.expressions[e].simplify();
 
-		if (thisExpr.expressions.size() == 2 && thisExpr.expressions[1].type == Expression::Invalid && thisExpr.expressions.back().stringVal == ":") {
+		if (thisExpr.expressions.size() == 2 && thisExpr.expressions[1].type == Expression::Invalid && thisExpr.expressions.back().str() == ":") {
 			flattenNestedExpr(thisExpr.expressions[0]);
 			continue;
 		}
 
-		const vector<Expression> &line = thisExpr.expressions;
-		const string &command = line[0].stringVal;
+		const ExprList &line = thisExpr.expressions;
+		if (line[0].type != Expression::Identifier) return { UnexpectedToken, line[0].toString().str() }; // A macro at the start gave a value
+
+		const string &command = line[0].str();
 
 		if (command.front() != '%') {
-			if (command.front() != '_') return { UnexpectedToken, command };
-			else continue;
-		}
+			if (command.front() == '_') continue;
 
-		if (command == "%define") { // %define ['global'] ['eval'] <macro> [value...]
-			result = defineMacro(line, globalMacros, rFileStack_.back().macros, macroMap);
-		}
-		else if (command == "%undef") { // %undef ['global'] <macro>
-			result = undefMacro(line, globalMacros, rFileStack_.back().macros, macroMap);
-		}
-		else if (command == "%include") { // %include <file> [args...]
-			result = includeFile(line, rScript_, l, rFileStack_, files);
-		}
-		else if (command == "%if") { // %if <cond>
-			result = ifCondition(line, rScript_, l, rFileStack_.back().line, macroMap);
+			auto mnemonic = mnemonics.find(line[0].symbol);
+			if (mnemonic == mnemonics.end()) return { UnexpectedToken, command };
+
+			result = expandMnemonic(thisExpr, mnemonic->second, macros);
+			if (result.code != NoError) break;
+			continue;
 		}
-		else if (command == "%endif") { // %if <cond>
+
+		directive = getDirectiveEnum(command); // The command could have been replaced by a macro
+
+		switch (directive) {
+		case DirDefine: // %define ['global'] ['eval'] <macro> [value...]
+			result = defineMacro(line, macros);
+			break;
+
+		case DirUndef: // %undef ['global'] <macro>
+			result = undefMacro(line, macros);
+			break;
+
+		case DirInclude: // %include <file> [args...]
+			result = includeFile(line, cursor, rFileStack_, files, onceFiles, macros);
+			break;
+
+		case DirIf: // %if <cond>
+			result = ifCondition(line, cursor, rFileStack_.back().line, macros, elifPending);
+			break;
+
+		case DirElif: // %elif <cond>
+			result = elifCondition(line, cursor, rFileStack_.back().line, macros, elifReached, elifPending);
+			break;
+
+		case DirElse: // %else
+			result = elseCondition(line, cursor, rFileStack_.back().line);
+			break;
+
+		case DirEndif: // %endif
 			// Do nothing
-		}
-		else if (command == "%file_def") { // %file_def <name>
-			result = defineFile(line, rScript_, l, rFileStack_, files);
-		}
-		else if (command == "%file_end") { // %file_end
+			break;
+
+		case DirFileDef: // %file_def <name>
+			result = defineFile(line, cursor, rFileStack_, files);
+			break;
+
+		case DirFileEnd: // %file_end
 			if (line.size() != 1)
 				return { InvalidArgumentCount, "0" };
-		}
-		else if (command == "%file_push") { // %file_push <path> [args...]
-			result = pushFile(line, rFileStack_, globalMacros, macroMap);
-		}
-		else if (command == "%file_pop") { // %file_pop
+			break;
+
+		case DirFilePush: // %file_push <path> [args...]
+			result = pushFile(line, rFileStack_, macros);
+			break;
+
+		case DirFilePop: // %file_pop
 			if (line.size() != 1)
 				return { InvalidArgumentCount, "0" };
 
 			if (rFileStack_.size() > 1) {
 				rFileStack_.pop_back();
-				genFinalMacroMap(macroMap, rFileStack_.back().macros, globalMacros);
+				macros.popScope();
 			}
-		}
-		else if (command == "%inherit") { // %inherit <'all'/macros...>
-			result = inheritMacros(line, rFileStack_, globalMacros, macroMap);
-		}
-		else if (command == "%marker") { // %marker <text>
+			break;
+
+		case DirInherit: // %inherit <'all'/macros...>
+			result = inheritMacros(line, rFileStack_, macros);
+			break;
+
+		case DirMarker: // %marker <text>
 			// To prevent UnknownInstruction error
-		}
-		else if (command == "%skip_to") { // %skip_to <byte>
-			
-		}
-		else if (command == "%align") { // %align <num_of_bytes>
+			break;
 
-		}
-		else if (command == "%error") { // %error [code] <text>
+		case DirSkipTo: // %skip_to <byte>
+			break;
+
+		case DirAlign: // %align <num_of_bytes>
+			break;
+
+		case DirError: // %error [code] <text>
 			result = errorDirective(line);
-		}
-		else {
+			break;
+
+		case DirMnemonic: // %mnemonic <name>[(params...)] <template> [fields...]
+			result = defineMnemonic(line, mnemonics);
+			break;
+
+		case DirOnce: // %once
+			if (line.size() != 1)
+				return { InvalidArgumentCount, "0" };
+
+			onceFiles.insert(rFileStack_.back().location.path + rFileStack_.back().location.name);
+			break;
+
+		default:
 			return { InvalidInstruction, command };
 		}
 
@@ -107,4 +162,17 @@ Result preprocessor(vector<Expression> &rScript_, vector<ProcessedFile> &rFileSt
 	}
 
 	return result;
+}
+
+Result preprocessor(vector<Expression> &rScript_, vector<ProcessedFile> &rFileStack_) {
+	ScriptCursor cursor(std::make_shared<const ScriptBody>(std::move(rScript_)));
+	Result result = preprocess(cursor, rFileStack_, {});
+
+	rScript_ = std::move(cursor.output);
+	return result;
+}
+
+Result preprocessor(ScriptReader &rMain_, vector<ProcessedFile> &rFileStack_, const LineSink &sink_) {
+	ScriptCursor cursor(rMain_);
+	return preprocess(cursor, rFileStack_, sink_);
 }
\ No newline at end of file
@@ -5,6 +5,10 @@
 #include "parser.hpp"
 #include "compiler_commands.hpp"
 
-Result preprocessor(vector<Expression> &rTokScript_, vector<ProcessedFile> &rFileStack_);
+// Receives the preprocessed lines in order, each one once nothing can change it any more
+using LineSink = std::function<void(Expression &)>;
+
+Result preprocessor(vector<Expression> &rTokScript_, vector<ProcessedFile> &rFileStack_); // The preprocessed script is left in rTokScript_
+Result preprocessor(ScriptReader &rMain_, vector<ProcessedFile> &rFileStack_, const LineSink &sink_); // The lines are handed to sink_ while the main file is read
 
 #endif
\ No newline at end of file
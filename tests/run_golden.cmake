@@ -0,0 +1,58 @@
+# Compiles one program and compares the results with the expected files.
+# Run by ctest as: cmake -DCOMPILER=<sb-uasm> -DSOURCE=<src> -DOUTPUT=<out> -DEXPECTED=<prefix> [-DARGS=<list>] -P run_golden.cmake
+#
+# <prefix>.out is the expected console output. The output file and its .map are compared with <prefix>.<ext of OUTPUT>[.map],
+# or with the hash in <prefix>.<ext>[.map].sha256. Without either, the compiler must not have written the file.
+
+get_filename_component(outExt "${OUTPUT}" LAST_EXT)
+get_filename_component(sourceDir "${SOURCE}" DIRECTORY)
+
+file(REMOVE "${OUTPUT}" "${OUTPUT}.map" "${OUTPUT}.part" "${OUTPUT}.map.part")
+
+execute_process(
+	COMMAND "${COMPILER}" "${SOURCE}" "${OUTPUT}" ${ARGS}
+	WORKING_DIRECTORY "${sourceDir}"
+	OUTPUT_VARIABLE console
+	ERROR_VARIABLE console
+)
+
+set(failed FALSE)
+
+file(READ "${EXPECTED}.out" expectedConsole)
+if(NOT console STREQUAL expectedConsole)
+	message("Console output differs from ${EXPECTED}.out:\n${console}")
+	set(failed TRUE)
+endif()
+
+foreach(suffix "" ".map")
+	set(expectedFile "${EXPECTED}${outExt}${suffix}")
+	if(EXISTS "${expectedFile}")
+		execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${OUTPUT}${suffix}" "${expectedFile}" RESULT_VARIABLE differs)
+		if(differs)
+			message("${OUTPUT}${suffix} differs from ${expectedFile}")
+			set(failed TRUE)
+		endif()
+	elseif(EXISTS "${expectedFile}.sha256") # For outputs too big to keep
+		file(STRINGS "${expectedFile}.sha256" expectedHash LIMIT_COUNT 1)
+		set(hash "")
+		if(EXISTS "${OUTPUT}${suffix}")
+			file(SHA256 "${OUTPUT}${suffix}" hash)
+		endif()
+		if(NOT hash STREQUAL expectedHash)
+			message("${OUTPUT}${suffix} doesn't match ${expectedFile}.sha256")
+			set(failed TRUE)
+		endif()
+	elseif(EXISTS "${OUTPUT}${suffix}")
+		message("${OUTPUT}${suffix} was written, but there is no ${expectedFile}")
+		set(failed TRUE)
+	endif()
+
+	if(EXISTS "${OUTPUT}${suffix}.part")
+		message("${OUTPUT}${suffix}.part was left behind")
+		set(failed TRUE)
+	endif()
+endforeach()
+
+if(failed)
+	message(FATAL_ERROR "${SOURCE} ${ARGS}")
+endif()